@@ -53,6 +53,9 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+// CAN interrupt handlers, running from RAM (see RAMFUNC). main() points the RAM vector table at them.
+__attribute__((long_call)) void can_irq(void);
+__attribute__((long_call)) void can_tx_irq(void);
 
 /* USER CODE END EFP */
 
@@ -65,38 +68,93 @@ void Error_Handler(void);
 
 
 #define PAGE_SIZE 0x100 // Page size in words
-#define BUILD_TIMESTAMP UNIX_TIMESTAMP //timestamp for when the bootloader was built. 
+// CRC unit: CRC-32/MPEG-2, one 32-bit word at a time
+#define CRC_INIT 0xFFFFFFFFUL
+#define CRC_POLY 0x04C11DB7UL
+#define CRC_X_PAGE 0x7001E426UL // x^(32 * PAGE_SIZE) mod CRC_POLY, for combining page CRCs
+#define RX_RING_SIZE 32 // Received frames waiting for the main loop. Must be a power of 2.
+#define TX_RING_SIZE 16 // Replies waiting for a TX mailbox. Must be a power of 2.
+#define FLS_CHUNK 16 // Words programmed between passes over the received frames
+#define READ_WINDOW 16 // Frames BL_CMD_READ_MEM sends before the host grants more with BL_CMD_READ_CREDIT
+#define VECTOR_COUNT (16 + USBWakeUp_IRQn + 1) // Cortex-M3 exceptions + STM32F103 interrupts
+
+// Code that has to keep running while flash is busy. Copied to RAM by the startup code.
+#define RAMFUNC __attribute__((section(".ramfunc"), long_call, noinline))
+// Code of the boot stage in page 0, see boot_stage_reset
+#define BOOT_STAGE __attribute__((section(".boot_stage")))
 
 //-----------------------------------------------------------------------------
 //  Typedefs
 //-----------------------------------------------------------------------------
 
+// Start of the vars. Bootloaders take over the vars of older (and newer) ones through these, see vars_migrate.
+struct vars_header_t
+{
+  uint32_t magic;   // VARS_MAGIC_VAL
+  uint16_t version; // VARS_VERSION of the bootloader that wrote the vars
+  uint16_t size;    // sizeof(struct bl_vars_t) of that bootloader, in bytes
+};
+
 struct app_vars_t
 {
   // Application binary size
   uint32_t page_count;
   // CRC of application to verify before jumping to it
 	uint32_t crc;
+  // APP_VERIFIED_VAL once the CRC has been checked, APP_UNCHECKED_VAL (erased) until then. Cleared (programmed to 0)
+  // when a check fails and before any app page is erased.
+  uint32_t verified;
+  // APP_CONFIRMED_VAL once the app reported healthy after a boot (see app_health_update)
+  uint32_t confirmed;
+};
+
+// Image in the backup slot. page_count 0 = none.
+struct backup_vars_t
+{
+  uint32_t page_count;
+  uint32_t crc;
 };
 
 struct board_vars_t
 {
-  // Timestamp from bootloader build. Used to reset data when flashing new bootloader.
-  uint64_t bl_build_version;
   // Board ID for bootloader. Must be different for each board
   uint8_t id;
-  uint8_t _padding[3];
+  // Multicast group for flashing identical boards together. 0 = not in a group
+  uint8_t group;
+  // Milliseconds to listen for the flasher after power-on before starting the app. 0 = start the app right away
+  uint16_t boot_window;
+  // Boots between full app CRC checks. 0 = CRC_INTERVAL_DEFAULT, 1 = every boot
+  uint16_t crc_interval;
+  uint8_t _padding[2];
 };
 
 
+// Fields are only ever added at the end, and have to take 0 as their default. A bootloader finding vars of an older
+// version keeps what they have and zeroes the rest, one finding a newer version keeps the part it knows. Anything else
+// needs a new VARS_VERSION and a conversion in vars_migrate.
 struct bl_vars_t // size has to be a multiple of 4
 {
+  struct vars_header_t hdr;
   struct app_vars_t app;
   struct board_vars_t board;
+  struct backup_vars_t backup;
 };
 
 _Static_assert(sizeof(struct bl_vars_t) % 4 == 0);
 
+// Vars of the bootloaders before the header (version 1). They were reset whenever the build timestamp didn't match
+// bl_build_version. Only read to migrate them.
+struct bl_vars_v1_t
+{
+  uint32_t page_count;
+  uint32_t crc;
+  uint64_t bl_build_version;
+  uint8_t id;
+  uint8_t _padding[3];
+};
+
+_Static_assert(sizeof(struct bl_vars_v1_t) == 24);
+
 struct __packed bl_cmd_t 
 {
 	uint8_t brd;
@@ -107,6 +165,15 @@ struct __packed bl_cmd_t
 
 _Static_assert (sizeof(struct bl_cmd_t) == 8);
 
+// CAN frame, as queued by the RX interrupt or for the TX interrupt. Much smaller than the HAL headers.
+struct can_frame_t
+{
+  uint32_t id; // StdId or ExtId
+  uint8_t ide;
+  uint8_t dlc;
+  uint8_t data[8];
+};
+
 //-----------------------------------------------------------------------------
 // Constants
 //-----------------------------------------------------------------------------
@@ -114,20 +181,165 @@ _Static_assert (sizeof(struct bl_cmd_t) == 8);
 // CAN IDs for bootloader to respond to
 static const uint16_t CANID_BOOTLOADER_CMD = 0x700;
 static const uint16_t CANID_BOOTLOADER_RPLY = 0x701;
+// Page transfer commands sent here are addressed to a multicast group instead of a board
+static const uint16_t CANID_BOOTLOADER_GRP_CMD = 0x6FF;
+
+// Words that survive a reset. They live in .noinit, so neither the startup code nor a growing .bss can clear them,
+// and the linker script puts them at the start of RAM so the app can set the request (see app_lib/bl_app.h).
+struct boot_flags_t
+{
+  uint32_t request; // BOOT_REQUEST_VAL: the app wants the bootloader to wait for the flasher
+  uint32_t magic;   // MAGIC_VAL: skip the bootloader and jump to the app
+};
+extern struct boot_flags_t boot_flags;
+
+// Left by the app's HardFault handler (see app_lib/bl_app.h) before it resets, or by the bootloader itself after a
+// watchdog reset. Follows the boot flags in .noinit, and apps keep their RAM clear of both, so it survives until it is
+// read with BL_CMD_READ_CRASH or power is lost.
+#define CRASH_STACK_WORDS 32
+struct crash_record_t
+{
+  uint32_t magic;      // CRASH_MAGIC_VAL if the rest is valid
+  uint32_t reset_csr;  // RCC->CSR of the reset that followed. Filled in by the bootloader, 0 until then.
+  uint32_t exc_return; // LR on entry to the fault handler. 0 if no fault was caught (watchdog reset).
+  uint32_t sp;         // Stack pointer before the fault
+  uint32_t cfsr;       // SCB fault status and address registers
+  uint32_t hfsr;
+  uint32_t mmfar;
+  uint32_t bfar;
+  uint32_t frame[8];                  // r0-r3, r12, lr, pc, xpsr stacked by the fault
+  uint32_t stack[CRASH_STACK_WORDS]; // Stack above the frame, 0 past the end of RAM
+};
+extern struct crash_record_t crash_record;
+static const uint32_t CRASH_MAGIC_VAL = (uint32_t)(0xc4a5b10c);
+
+// How a new image is doing, see app_health_update. Follows the crash record, the app sets healthy.
+struct boot_health_t
+{
+  uint32_t magic;   // HEALTH_MAGIC_VAL while an image that hasn't reported healthy yet is on trial
+  uint32_t crashes; // Boots of it that ended in a crash
+  uint32_t healthy; // APP_HEALTHY_VAL once the app got far enough (bl_app_healthy in app_lib/bl_app.h)
+};
+extern struct boot_health_t boot_health;
+static const uint32_t HEALTH_MAGIC_VAL = (uint32_t)(0x4ea17401);
+static const uint32_t APP_HEALTHY_VAL = (uint32_t)(0x600dc0de);
+#define BOOT_ATTEMPTS 3 // Crashes in a row before a new image is rolled back
+
+// Version of the layout above, set by the bootloader at every boot after the shared words were read. It only lasts
+// until the next boot if the app keeps the start of RAM free (BL_SHARED_RAM in app_lib/bl_app.h). Apps linked for all of
+// RAM overwrite it along with the words above, which are then ignored rather than taken for a request, crash or trial.
+extern uint32_t shared_ram_abi;
+static const uint32_t SHARED_RAM_ABI_VAL = (uint32_t)(0x5a4ed001); // Low byte: version 1
 
 // Magic value stored in memory - if this is present, skip bootloader and jump to app
 static const uint32_t MAGIC_VAL = (uint32_t)(0x36051bf3);
-static uint32_t* const MAGIC_ADDR = (uint32_t*)(SRAM_BASE + 0x1000);
+static uint32_t* const MAGIC_ADDR = &boot_flags.magic;
+// Where the first bootloaders kept the magic value, and apps written for them may still set it. Honoured after a
+// software reset. The bootloader clears it before resetting itself, since its own .bss lives there.
+static uint32_t* const LEGACY_MAGIC_ADDR = (uint32_t*)(SRAM_BASE + 0x1000);
+
+// Set by the app before resetting to ask the bootloader to wait for the flasher instead of starting the app again
+static const uint32_t BOOT_REQUEST_VAL = (uint32_t)(0x5b0071e2);
 
 // Base address to write app
 #define APP_BASE ((uint32_t *)(0x08003000))
-#define PAGE_COUNT (64 - 12)
+#define RAM_END (SRAM_BASE + 20 * 1024) // Top of the app's stack must be in RAM
+#define PAGE_COUNT (64 - 13) // Pages of the app region, between the vars page and the boot tally page
+// The upper half of the app region is free while the app fits into the lower half. It then holds a copy of the last
+// app that reported healthy (put back if a new app keeps crashing), or an image staged by the download agent or for a
+// bootloader update. Bigger apps use the whole region and go without.
+#define BACKUP_PAGES (PAGE_COUNT / 2)
+#define BACKUP_FIRST_PAGE (PAGE_COUNT - BACKUP_PAGES)
+#define BACKUP_BASE (APP_BASE + BACKUP_FIRST_PAGE * PAGE_SIZE)
 // static const uint32_t* APP_BASE = (uint32_t*)(0x08003000);
 // static const uint16_t PAGE_COUNT = 64 - 12;
 
+// The bootloader's own flash: the boot stage in page 0, the bootloader proper from page 1 (g_pfnVectors), then the
+// vars page
+#define BL_PAGES 11
+#define BL_MAIN_VECTORS ((const uint32_t *)(FLASH_BASE + 4 * PAGE_SIZE))
+
 // Location where pvars are stored
 #define FLASH_VARS ((volatile struct bl_vars_t *)(APP_BASE - PAGE_SIZE))
 
+// RAM stubs (BL_CMD_LOAD_STUB, BL_CMD_RUN_STUB) are entered as
+//   uint8_t entry(struct stub_args_t *args)
+// in Thumb state, on the bootloader's stack, with interrupts on. The return code and args->result go back to the host.
+// Stubs running longer than 400 ms have to reload the watchdog (IWDG->KR = 0xAAAA). See app_lib/bl_stub.h.
+#define STUB_SIZE PAGE_SIZE // words
+#define STUB_ABI_VERSION 1
+struct stub_args_t
+{
+  uint32_t abi_version; // STUB_ABI_VERSION
+  uint32_t arg;         // par2 of BL_CMD_RUN_STUB
+  uint32_t *buf;        // Page buffer, holding whatever the host sent after BL_CMD_LOAD_STUB
+  uint32_t buf_words;
+  uint32_t result;      // Sent back to the host next to the return code
+  // Flash routines of the bootloader, running from RAM. Flash has to be unlocked. Return 0 on success.
+  uint8_t (*erase)(const uint32_t *page);
+  uint8_t (*prog)(const uint32_t *page, const uint32_t *buf, uint32_t len);
+};
+
+// BL_CMD_READ_MEM reads the settings page and the app, word offsets counted from the settings page
+#define READ_BASE (APP_BASE - PAGE_SIZE)
+#define READ_SIZE ((PAGE_COUNT + 1) * PAGE_SIZE) // words, up to the end of the app region
+
+// Boots since the tally was started, one programmed (zero) word per boot in the last page of flash. Counting this way
+// needs no erase, and the page holds nothing else, so app_check can erase it to start over without putting the vars at
+// risk. A tally cut short by a power loss only reads as more boots.
+#define BOOT_TALLY_SIZE PAGE_SIZE // words
+#define BOOT_TALLY ((volatile uint32_t *)(APP_BASE + PAGE_COUNT * PAGE_SIZE))
+
+// Image the download agent in the app (app_lib/bl_agent.c) staged in the backup slot, 64 words below the end of the
+// vars page, where the agent programs it (BL_STAGE_REQ_ADDR). Writing the vars leaves it erased, so the app can program
+// it without erasing the page. See app_stage_apply.
+struct stage_req_t
+{
+  uint32_t open;       // STAGE_OPEN_VAL once the agent started overwriting the backup slot
+  uint32_t page_count; // page_count, crc and ready are programmed once the staged image passed its CRC
+  uint32_t crc;
+  uint32_t ready; // STAGE_READY_VAL
+};
+#define STAGE_REQ_GAP 64 // words between the stage request and the end of the vars page, unused
+#define STAGE_REQ ((volatile struct stage_req_t *)(APP_BASE - STAGE_REQ_GAP - sizeof(struct stage_req_t) / 4))
+static const uint32_t STAGE_OPEN_VAL = (uint32_t)(0x57a6e0be);
+static const uint32_t STAGE_READY_VAL = (uint32_t)(0x57a6e4d1);
+// Progress of swapping in a staged image, three programmed words per page below the stage request
+#define SWAP_TALLY ((volatile uint32_t *)STAGE_REQ - 3 * BACKUP_PAGES)
+
+// Bootloader self-update (BL_CMD_UPDATE_BL), below the swap tally. The boot stage copies pages 1 and up of the image in
+// the backup slot over the bootloader and marks each page done, so a reset or power loss only delays it.
+struct bl_update_t
+{
+  uint32_t page_count;
+  uint32_t magic;          // BL_UPDATE_MAGIC_VAL, programmed last
+  uint32_t done[BL_PAGES]; // 0 once the page is copied
+};
+#define BL_UPDATE ((volatile struct bl_update_t *)(SWAP_TALLY - sizeof(struct bl_update_t) / 4))
+static const uint32_t BL_UPDATE_MAGIC_VAL = (uint32_t)(0xb1ed17e5);
+// Copies of a page the boot stage tries before it starts the app instead, see boot_stage_reset
+#define STAGE_COPY_TRIES 3
+_Static_assert(sizeof(struct bl_vars_t) + sizeof(struct stage_req_t) + sizeof(struct bl_update_t) <=
+               4 * (PAGE_SIZE - STAGE_REQ_GAP - 3 * BACKUP_PAGES));
+
+// Value of hdr.magic once the vars have a header
+static const uint32_t VARS_MAGIC_VAL = (uint32_t)(0x7a125e7a);
+static const uint16_t VARS_VERSION = 2;
+
+// Value of app.verified for an image whose CRC has been checked
+static const uint32_t APP_VERIFIED_VAL = (uint32_t)(0x7e5a11d0);
+// Value of app.verified for an image installed by the bootloader itself. The first passing full check programs
+// APP_VERIFIED_VAL over it.
+static const uint32_t APP_UNCHECKED_VAL = (uint32_t)(0xFFFFFFFF);
+
+// Value of app.confirmed for an image that reported healthy
+static const uint32_t APP_CONFIRMED_VAL = (uint32_t)(0xc0f1c0de);
+
+// Full app CRC check every this many boots, unless set with BL_CMD_SET_CRC_INTERVAL. Boots in between only check
+// the vector table. Watchdog resets always get the full check.
+#define CRC_INTERVAL_DEFAULT 16
+#define CRC_INTERVAL_MAX 64 // Longest interval BL_CMD_SET_CRC_INTERVAL accepts
+
 
 // Bootloader commands
 static const uint8_t BL_CMD_WRITE_BUF = 1; // Writes to the page buffer
@@ -135,6 +347,66 @@ static const uint8_t BL_CMD_WRITE_PAGE = 2; // Writes from the page buffer to fl
 static const uint8_t BL_CMD_WRITE_CRC = 3; // Verify the entire program with a CRC
 static const uint8_t BL_CMD_PING = 4; // Do nothing and respond
 static const uint8_t BL_CMD_SET_ID = 5; // Update the board's ID
+static const uint8_t BL_CMD_STREAM_BUF = 6; // Writes to the page buffer without replying on success (burst mode)
+static const uint8_t BL_CMD_BUF_STATUS = 7; // Reports which words of the page buffer have not been received
+static const uint8_t BL_CMD_SET_GROUP = 8; // Update the board's multicast group
+static const uint8_t BL_CMD_PAGE_CRC = 9; // Reports the CRC of a range of app pages, one reply per page
+static const uint8_t BL_CMD_DECOMPRESS = 10; // Decompresses an LZ4 block from the compressed buffer into the page buffer
+static const uint8_t BL_CMD_APP_INFO = 11; // Reports the page count and CRC of the installed app
+static const uint8_t BL_CMD_STATS = 12; // Reports receive and transmit queue counters
+static const uint8_t BL_CMD_BITRATE = 13; // Switches the CAN bit rate for the rest of the session
+static const uint8_t BL_CMD_SET_BOOT_WINDOW = 14; // Update how long the board listens after power-on
+static const uint8_t BL_CMD_SET_CRC_INTERVAL = 15; // Update how many boots apart the full app CRC check runs
+static const uint8_t BL_CMD_READ_MEM = 16; // Streams a range of flash back in dense data frames, then its CRC
+static const uint8_t BL_CMD_READ_CREDIT = 17; // Lets BL_CMD_READ_MEM send more frames. No reply.
+static const uint8_t BL_CMD_READ_CRASH = 18; // Streams the crash record back like BL_CMD_READ_MEM, or clears it
+static const uint8_t BL_CMD_LOAD_STUB = 19; // Copies code from the page buffer into stub RAM, after checking its CRC
+static const uint8_t BL_CMD_RUN_STUB = 20; // Calls the loaded stub and replies with its return code
+static const uint8_t BL_CMD_UPDATE_BL = 21; // Replaces the bootloader with the image staged in the backup slot
+
+// Dense data frames use a 29-bit extended ID so all 8 data bytes carry payload:
+//   bits 28-20: 0x1B7 (bootloader data), bits 19-16: frame type, bits 15-8: board ID, bits 7-0: word offset
+#define CANID_BL_DATA_EXT 0x1B700000UL
+#define CANID_BL_DATA_EXT_MASK 0x1FF00000UL
+#define BL_EXT_TYPE(id) (((id) >> 16) & 0x0F)
+#define BL_EXT_BRD(id) (((id) >> 8) & 0xFF)
+#define BL_EXT_OFS(id) ((id) & 0xFF)
+
+// Dense data frame types. Setting BL_DATA_GROUP means bits 15-8 hold a multicast group ID instead of a board ID.
+#define BL_DATA_GROUP 0x1
+#define BL_DATA_PAGE 0 // Two words of page buffer data, written at the word offset
+#define BL_DATA_GROUP_PAGE (BL_DATA_PAGE | BL_DATA_GROUP)
+#define BL_DATA_ZBUF 2 // Two words of LZ4 compressed page data, see BL_CMD_DECOMPRESS
+#define BL_DATA_READ 4 // Two words of flash sent by the board for BL_CMD_READ_MEM. The offset is the frame number.
+
+// Capability flags reported in bytes 3-6 of the ping reply
+#define BL_CAP_STREAM (1UL << 0) // BL_CMD_STREAM_BUF is supported
+#define BL_CAP_SACK (1UL << 1)   // BL_CMD_BUF_STATUS is supported
+#define BL_CAP_DENSE (1UL << 2)  // Dense extended ID data frames are supported
+#define BL_CAP_GROUP (1UL << 3)  // Multicast groups are supported
+#define BL_CAP_PAGE_CRC (1UL << 4) // BL_CMD_PAGE_CRC is supported
+#define BL_CAP_LZ4 (1UL << 5)      // BL_CMD_DECOMPRESS and BL_DATA_ZBUF frames are supported
+#define BL_CAP_DELTA (1UL << 6)    // BL_CMD_DECOMPRESS takes a flash dictionary, BL_CMD_APP_INFO is supported
+#define BL_CAP_STATS (1UL << 7)    // BL_CMD_STATS is supported
+#define BL_CAP_BITRATE (1UL << 8)  // BL_CMD_BITRATE is supported
+#define BL_CAP_FAST_BOOT (1UL << 9) // Power-on starts the app without waiting, BL_CMD_SET_BOOT_WINDOW is supported
+#define BL_CAP_CRC_INTERVAL (1UL << 10) // Full app CRC only every few boots, BL_CMD_SET_CRC_INTERVAL is supported
+#define BL_CAP_READ_MEM (1UL << 11) // BL_CMD_READ_MEM and BL_CMD_READ_CREDIT are supported
+#define BL_CAP_CRASH (1UL << 12)    // Crash records are kept, BL_CMD_READ_CRASH is supported
+#define BL_CAP_STUB (1UL << 13)     // BL_CMD_LOAD_STUB and BL_CMD_RUN_STUB are supported
+#define BL_CAP_ROLLBACK (1UL << 14) // Backup slot in the upper half of the app region, rollback of crashing apps
+#define BL_CAP_AGENT (1UL << 15)    // Reported by the download agent in the app (app_lib/bl_agent.h), never by the bootloader
+#define BL_CAP_UPDATE_BL (1UL << 16) // BL_CMD_UPDATE_BL is supported
+
+#define BL_CAPS (BL_CAP_STREAM | BL_CAP_SACK | BL_CAP_DENSE | BL_CAP_GROUP | BL_CAP_PAGE_CRC | BL_CAP_LZ4 | \
+                 BL_CAP_DELTA | BL_CAP_STATS | BL_CAP_BITRATE | BL_CAP_FAST_BOOT | BL_CAP_CRC_INTERVAL | \
+                 BL_CAP_READ_MEM | BL_CAP_CRASH | BL_CAP_STUB | BL_CAP_ROLLBACK | \
+                 BL_CAP_UPDATE_BL)
+
+// Bit rates for BL_CMD_BITRATE
+#define BL_BITRATE_500K 0 // What the bootloader always starts with
+#define BL_BITRATE_1M 1
+#define BL_BITRATE_COUNT 2
 
 // Bootloader error codes
 static const uint8_t BL_SUCCESS = 0;
@@ -143,14 +415,31 @@ static const uint8_t BL_ERR_INVALID_CRC = 2;
 static const uint8_t BL_ERR_FLASH_WRITE = 3;
 static const uint8_t BL_ERR_INVALID_ID = 4;
 static const uint8_t BL_ERR_INVALID_OFFSET = 5;
+static const uint8_t BL_ERR_DECOMPRESS = 6;
+static const uint8_t BL_ERR_BUSY = 7; // Still programming the previous page, send the command again
+static const uint8_t BL_ERR_INVALID_BITRATE = 8;
+static const uint8_t BL_ERR_BOOT_STAGE = 9; // The new bootloader has a different boot stage, flash it with a debugger
+
+// No page, e.g. no failed page to report
+static const uint8_t BL_NO_PAGE = 0xFF;
 
-// How long the bootloader runs on startup if it doesn't receive a CAN message
-// The main application will not run until this timeout expires
+// How long the bootloader runs on startup if it doesn't receive a CAN message, after a reset that may mean someone
+// wants to flash the board (software, watchdog or reset pin) or when there is no valid app.
+// Power-on starts a valid app right away, unless a boot window is set.
 static const uint32_t STARTUP_TO = 200; // milliseconds
 
 // Timeout after last CAN message to restart
 static const uint32_t NOCANRX_TO = 2000; // milliseconds
 
+// How long after BL_CMD_BITRATE to switch, so other group members' replies get out at the old bit rate first
+static const uint32_t BITRATE_DELAY = 20; // milliseconds
+
+// How long a new bit rate is kept without receiving a frame at it, before going back to 500 kbit/s
+static const uint32_t BITRATE_TO = 500; // milliseconds
+
+// How long to spin waiting for room in the TX queue before dropping a reply (roughly 5 ms)
+static const uint32_t TX_WAIT_LOOPS = 20000;
+
 
 /* USER CODE END Private defines */
 
@@ -22,7 +22,6 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include <string.h>
-#include "version.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -73,6 +72,180 @@ static void MX_IWDG_Init(void);
 // time (in ms) of last can message. Used for bootloader timeout.
 static volatile uint32_t lastcanrx;
 
+// How long to wait for the first CAN message before leaving the bootloader, see boot_listen_time
+static uint32_t startup_to = STARTUP_TO;
+
+// RCC->CSR reset flags of this boot, see boot_listen_time
+static uint32_t reset_csr;
+
+// Programmed over flash words to clear them without an erase
+static const uint32_t zero_word = 0;
+
+// Page data waiting to be written to flash. Data is received into pagebuf[rxbuf] while the main loop programs the
+// other buffer, so the host can send the next page without waiting for flash.
+static uint32_t pagebuf[2][PAGE_SIZE];
+static uint8_t rxbuf;
+// Compressed page data waiting to be decompressed into pagebuf[rxbuf]
+static uint32_t zbuf[PAGE_SIZE];
+// One bit per word of pagebuf[rxbuf] (or zbuf), set once the word has been received since the last WRITE_PAGE
+static uint32_t rxmask[PAGE_SIZE / 32];
+
+// Page handed over by WRITE_PAGE for the main loop to program, a chunk at a time
+static struct
+{
+  uint8_t busy;
+  uint8_t page;
+  uint8_t buf;
+  uint8_t erased;
+  uint16_t ofs; // Next word to program
+  uint32_t crc; // CRC of the buffer, becomes the page's entry in page_crcs once programmed
+  // Page that failed to program. Reported (once) in the reply to the next WRITE_PAGE or WRITE_CRC.
+  uint8_t err_page;
+} fls_job = {.err_page = BL_NO_PAGE};
+_Static_assert(PAGE_SIZE % FLS_CHUNK == 0);
+
+// Code loaded by LOAD_STUB, run by RUN_STUB
+static uint32_t stub_ram[STUB_SIZE] __attribute__((aligned(8)));
+static uint16_t stub_len; // Words loaded, 0 = none
+
+// Copy of the app into the backup slot, taken before an update erases the first page of an app that reported healthy.
+// Runs a step at a time like fls_job, which waits for it.
+static struct
+{
+  uint8_t busy;
+  uint8_t failed; // Don't try again before the next reset, go on without a backup
+  uint8_t page;
+  uint8_t erased;
+  uint16_t ofs;
+} backup_job;
+
+// Running CRC of pagebuf[rxbuf], folded in as words arrive in order. WRITE_PAGE only needs a pass over the buffer if
+// they didn't (lost words resent later, or a decompressed page).
+#define PAGE_RUN_BROKEN 0xFFFF
+static struct
+{
+  uint16_t ofs; // Words before ofs are in crc. PAGE_RUN_BROKEN once a word arrived out of order.
+  uint32_t crc;
+} page_run = {0, CRC_INIT};
+
+// CRCs of the app (and backup slot) pages as they are in flash, from PAGE_CRC and from programming pages. WRITE_CRC
+// combines them instead of reading the whole app again.
+static struct
+{
+  uint32_t crc[PAGE_COUNT];
+  uint32_t known[(PAGE_COUNT + 31) / 32];
+} page_crcs;
+
+// Whole-app CRC started by APP_INFO, which checks flash itself. The DMA feeds the CRC unit while the main loop keeps
+// handling frames, and crc_job_finish replies once it's done.
+static struct
+{
+  uint8_t busy;
+  uint8_t cmd;
+  uint8_t page_count;
+  uint32_t crc; // CRC the result has to match
+} crc_job;
+
+// Pages requested by PAGE_CRC. page_crc_job_step sends a reply per page as the TX queue has room.
+static struct
+{
+  uint8_t busy;
+  uint8_t page; // Next page to report on
+  uint8_t end;
+} page_crc_job;
+
+// Range requested by READ_MEM or READ_CRASH. read_job_step sends it as the TX queue and the host's credit allow.
+static struct
+{
+  uint8_t busy;
+  uint8_t cmd;    // Command to end with the CRC reply
+  const uint32_t *base;
+  uint16_t ofs;   // Next word to send, from base
+  uint16_t end;
+  uint16_t frame; // Frames sent so far. The offset field of each data frame is its low byte.
+  uint16_t limit; // Frames the host has room for, from READ_MEM and READ_CREDIT
+  uint32_t crc;   // Of the words sent so far
+} read_job;
+
+// Frames received by can_irq, waiting for the main loop. can_irq only writes head, the main loop only writes tail.
+// Each side copies the frame and only then stores its index, with __DMB() in between to keep that order. A slot is
+// only read after the other side's index was seen.
+static struct
+{
+  struct can_frame_t frames[RX_RING_SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+} rx_ring;
+
+// Replies waiting for a TX mailbox. The main loop only writes head, can_tx_irq only writes tail. Ordered like rx_ring.
+static struct
+{
+  struct can_frame_t frames[TX_RING_SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+} tx_ring;
+
+// Receive statistics, reported by BL_CMD_STATS
+static volatile struct
+{
+  uint8_t ring_max;       // Most frames ever waiting in the ring
+  uint16_t ring_drops;    // Frames dropped because the ring was full
+  uint16_t fifo_overruns; // Frames the CAN peripheral dropped because nobody emptied its FIFO in time
+} rx_stats;
+
+// Bit timings for BL_CMD_BITRATE, from the 36 MHz APB1 clock. Both sample at about 88%.
+static const struct
+{
+  uint32_t prescaler;
+  uint32_t bs1;
+  uint32_t bs2;
+} can_timings[BL_BITRATE_COUNT] = {
+    {9, CAN_BS1_6TQ, CAN_BS2_1TQ}, // 500 kbit/s, as set up by MX_CAN_Init
+    {4, CAN_BS1_7TQ, CAN_BS2_1TQ}, // 1 Mbit/s
+};
+
+// Bit rate switch requested by BL_CMD_BITRATE. It happens once the reply is out, and a new bit rate is on trial until
+// a frame arrives at it. A host that can't follow therefore gets the board back at 500 kbit/s.
+static struct
+{
+  uint8_t pending; // Switch to rate after BITRATE_DELAY
+  uint8_t trial;   // Go back to 500 kbit/s unless a frame arrives within BITRATE_TO
+  uint8_t rate;
+  uint32_t since;
+} bitrate;
+
+// Reset into the boot stage once the BL_CMD_UPDATE_BL reply has gone out
+static struct
+{
+  uint8_t pending;
+  uint32_t since;
+} bl_update;
+
+// Transmit statistics, reported by BL_CMD_STATS
+static volatile struct
+{
+  uint8_t ring_max;    // Most replies ever waiting in the ring
+  uint16_t ring_drops; // Replies dropped because the ring stayed full (bus stuck)
+} tx_stats;
+
+// Reboot magic value and boot request, see PreSystemInit and boot_listen_time
+struct boot_flags_t boot_flags __attribute__((section(".noinit.boot_flags")));
+
+// What the app left when it crashed, see crash_record_update
+struct crash_record_t crash_record __attribute__((section(".noinit.crash")));
+
+// Trial of a new image, see app_health_update
+struct boot_health_t boot_health __attribute__((section(".noinit.health")));
+
+// Whether the words above survived the app, see shared_ram_check
+uint32_t shared_ram_abi __attribute__((section(".noinit.abi")));
+
+// Copy of the vector table with the CAN interrupts pointing at can_irq and can_tx_irq, which run from RAM.
+// Aligned to the table size rounded up to a power of 2, as SCB->VTOR requires.
+extern uint32_t g_pfnVectors[];
+static uint32_t ram_vectors[VECTOR_COUNT] __attribute__((aligned(256)));
+_Static_assert(sizeof(ram_vectors) <= 256);
+
 //-----------------------------------------------------------------------------
 //  utility functions
 //-----------------------------------------------------------------------------
@@ -100,32 +273,158 @@ void configClocks(void)
     ; /* wait for it to come on */
 }
 
-uint8_t __fls_wr(const uint32_t *page, const uint32_t *buf, uint32_t len)
+// Flash erase and program run from RAM. The CPU stalls on any fetch from flash while it is busy, so this way the CAN
+// interrupt (also in RAM) keeps running. Lower priority interrupts are masked, their handlers are still in flash.
+// Flash has to be unlocked.
+RAMFUNC uint8_t fls_erase(const uint32_t *page)
 {
-  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR);
+  __set_BASEPRI(1 << (8 - __NVIC_PRIO_BITS));
+  FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+  FLASH->CR |= FLASH_CR_PER;
+  FLASH->AR = (uint32_t)page;
+  FLASH->CR |= FLASH_CR_STRT;
+  while (FLASH->SR & FLASH_SR_BSY)
+    ;
+  FLASH->CR &= ~FLASH_CR_PER;
+  __set_BASEPRI(0);
+
+  return (FLASH->SR & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) ? 1 : 0;
+}
+
+RAMFUNC uint8_t fls_prog(const uint32_t *page, const uint32_t *buf, uint32_t len)
+{
+  // Flash is programmed a halfword at a time
+  volatile uint16_t *dst = (volatile uint16_t *)page;
+  const uint16_t *src = (const uint16_t *)buf;
+  uint8_t r = 0;
+
+  __set_BASEPRI(1 << (8 - __NVIC_PRIO_BITS));
+  FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+  FLASH->CR |= FLASH_CR_PG;
+  for (uint32_t i = 0; i < 2 * len; ++i)
+  {
+    *dst++ = *src++;
+    while (FLASH->SR & FLASH_SR_BSY)
+      ;
+    if (FLASH->SR & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR))
+    {
+      r = 2;
+      break;
+    }
+  }
+  FLASH->CR &= ~FLASH_CR_PG;
+  __set_BASEPRI(0);
+
+  return r;
+}
+
+// CRC engine. DMA1 channel 1 copies words into CRC->DR (memory to memory, the source goes in the peripheral address
+// register), so the CPU is free while a long CRC runs. The result is the same as HAL_CRC_Calculate.
+static void crc_dma_start(const uint32_t *data, uint32_t len)
+{
+  DMA1_Channel1->CCR = 0;
+  DMA1->IFCR = DMA_IFCR_CGIF1;
+  CRC->CR = CRC_CR_RESET;
+  if (len == 0)
+    return;
+  DMA1_Channel1->CPAR = (uint32_t)data;
+  DMA1_Channel1->CMAR = (uint32_t)&CRC->DR;
+  DMA1_Channel1->CNDTR = len;
+  DMA1_Channel1->CCR = DMA_CCR_MEM2MEM | DMA_CCR_PL_0 | DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 | DMA_CCR_PINC |
+                       DMA_CCR_EN;
+}
+
+static uint8_t crc_dma_busy(void)
+{
+  return (DMA1_Channel1->CCR & DMA_CCR_EN) && !(DMA1->ISR & (DMA_ISR_TCIF1 | DMA_ISR_TEIF1));
+}
 
-  uint32_t erase_err;
-  FLASH_EraseInitTypeDef erase_page = {
-      FLASH_TYPEERASE_PAGES,
-      FLASH_BANK_1,
-      (uint32_t)page, 1};
+// Result of the CRC started by crc_dma_start. Only valid once crc_dma_busy returns 0.
+static uint32_t crc_dma_result(void)
+{
+  DMA1_Channel1->CCR = 0;
+  DMA1->IFCR = DMA_IFCR_CGIF1;
+  return CRC->DR;
+}
+
+// CRC of a short block (a page), waiting for the DMA
+static uint32_t crc_calc(const uint32_t *data, uint32_t len)
+{
+  crc_dma_start(data, len);
+  while (crc_dma_busy())
+    ;
+  return crc_dma_result();
+}
 
-  if (HAL_OK != HAL_FLASHEx_Erase(&erase_page, &erase_err))
+// Same as feeding one word to the CRC unit, in software so it doesn't disturb the unit. A nibble at a time.
+static uint32_t crc_sw_word(uint32_t crc, uint32_t word)
+{
+  static const uint32_t table[16] = {
+      0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+      0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
+  };
+  crc ^= word;
+  for (uint32_t i = 0; i < 8; ++i)
   {
-    return 1;
+    crc = (crc << 4) ^ table[crc >> 28];
   }
+  return crc;
+}
 
-  for (uint32_t i = 0; i < len; ++i)
+// a * b mod CRC_POLY (polynomials over GF(2), x^31 in bit 31)
+static uint32_t crc_gfmul(uint32_t a, uint32_t b)
+{
+  uint32_t r = 0;
+  for (uint32_t i = 0; i < 32; ++i)
   {
-    if (HAL_OK != HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t)page, *buf))
-    {
-      return 2;
-    }
-    ++page;
-    ++buf;
+    r = (r & 0x80000000UL) ? ((r << 1) ^ CRC_POLY) : (r << 1);
+    if (b & 0x80000000UL)
+      r ^= a;
+    b <<= 1;
   }
+  return r;
+}
 
-  return 0;
+static void page_crc_set(uint32_t page, uint32_t crc)
+{
+  page_crcs.crc[page] = crc;
+  page_crcs.known[page / 32] |= 1UL << (page % 32);
+}
+
+static void page_crc_forget(uint32_t page)
+{
+  page_crcs.known[page / 32] &= ~(1UL << (page % 32));
+}
+
+// CRC of an app page, read from flash only if it isn't known yet
+static uint32_t page_crc_get(uint32_t page)
+{
+  if (!(page_crcs.known[page / 32] & (1UL << (page % 32))))
+  {
+    page_crc_set(page, crc_calc(APP_BASE + page * PAGE_SIZE, PAGE_SIZE));
+  }
+  return page_crcs.crc[page];
+}
+
+// CRC of the first page_count app pages, combined from the page CRCs. Running a page through the CRC unit starting
+// from state s gives its CRC from CRC_INIT xor (s xor CRC_INIT) * x^(32 * PAGE_SIZE).
+static uint32_t app_crc_from_pages(uint32_t page_count)
+{
+  uint32_t crc = CRC_INIT;
+  for (uint32_t p = 0; p < page_count; ++p)
+  {
+    crc = page_crc_get(p) ^ crc_gfmul(crc ^ CRC_INIT, CRC_X_PAGE);
+  }
+  return crc;
+}
+
+uint8_t __fls_wr(const uint32_t *page, const uint32_t *buf, uint32_t len)
+{
+  if (fls_erase(page))
+  {
+    return 1;
+  }
+  return fls_prog(page, buf, len);
 }
 
 uint8_t fls_wr(const uint32_t *page, const uint32_t *buf, uint32_t len)
@@ -153,151 +452,1349 @@ uint8_t fls_wr(const uint32_t *page, const uint32_t *buf, uint32_t len)
   return 0;
 }
 
+// Change the CAN bit timing. Filters and interrupt enables survive the re-init.
+static void can_set_bitrate(uint8_t rate)
+{
+  HAL_CAN_Stop(&hcan);
+  hcan.Init.Prescaler = can_timings[rate].prescaler;
+  hcan.Init.TimeSeg1 = can_timings[rate].bs1;
+  hcan.Init.TimeSeg2 = can_timings[rate].bs2;
+  if ((HAL_CAN_Init(&hcan) != HAL_OK) || (HAL_CAN_Start(&hcan) != HAL_OK))
+  {
+    Error_Handler();
+  }
+}
+
+static uint8_t tx_ring_full(void)
+{
+  return ((tx_ring.head + 1) & (TX_RING_SIZE - 1)) == tx_ring.tail;
+}
+
+// Queue a frame for can_tx_irq, which sends queued frames in order as mailboxes free up. The queue must have room.
+static void tx_ring_push(const struct can_frame_t *frame)
+{
+  uint8_t next = (tx_ring.head + 1) & (TX_RING_SIZE - 1);
+  tx_ring.frames[tx_ring.head] = *frame;
+  __DMB();
+  tx_ring.head = next;
+
+  uint8_t used = (next - tx_ring.tail) & (TX_RING_SIZE - 1);
+  if (used > tx_stats.ring_max)
+    tx_stats.ring_max = used;
+
+  // Mailboxes may all be idle, in which case no TX interrupt is coming. Trigger one.
+  NVIC_SetPendingIRQ(USB_HP_CAN1_TX_IRQn);
+}
+
+// Reply to a command with an error code followed by up to 5 bytes of extra data.
+void bl_tx_resp_data(uint8_t cmd, uint8_t ec, const uint8_t *payload, uint8_t len)
+{
+  // Multi-frame replies can fill the queue. Wait for the TX interrupt to make room, unless the bus is stuck.
+  for (uint32_t i = 0; (i < TX_WAIT_LOOPS) && tx_ring_full(); ++i)
+    ;
+  if (tx_ring_full())
+  {
+    if (tx_stats.ring_drops < UINT16_MAX)
+      ++tx_stats.ring_drops;
+    return;
+  }
+
+  struct can_frame_t f;
+  f.id = CANID_BOOTLOADER_RPLY + FLASH_VARS->board.id;
+  f.ide = CAN_ID_STD;
+  f.dlc = 3 + len;
+  f.data[0] = FLASH_VARS->board.id;
+  f.data[1] = cmd;
+  f.data[2] = ec;
+  if (len)
+    memcpy(&f.data[3], payload, len);
+  tx_ring_push(&f);
+}
+
+// Decompress an LZ4 block into dst. Matches can reach back past the start of dst into the last dictlen bytes of dict,
+// as if dict came right before dst.
+// Returns the number of bytes written, or -1 if the block is malformed or doesn't fit.
+int32_t lz4_decompress(const uint8_t *src, uint32_t srclen, uint8_t *dst, uint32_t dstlen,
+                       const uint8_t *dict, uint32_t dictlen)
+{
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + srclen;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dstlen;
+
+  while (ip < iend)
+  {
+    uint8_t token = *ip++;
+
+    // Literals. A length of 15 continues in following bytes until one isn't 255.
+    uint32_t len = token >> 4;
+    if (len == 15)
+    {
+      uint8_t b;
+      do
+      {
+        if (ip >= iend)
+          return -1;
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+    if (((uint32_t)(iend - ip) < len) || ((uint32_t)(oend - op) < len))
+      return -1;
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    // The last sequence is only literals
+    if (ip >= iend)
+      break;
+
+    // Match
+    if (iend - ip < 2)
+      return -1;
+    uint32_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if ((offset == 0) || (offset > (uint32_t)(op - dst) + dictlen))
+      return -1;
+
+    len = token & 0x0F;
+    if (len == 15)
+    {
+      uint8_t b;
+      do
+      {
+        if (ip >= iend)
+          return -1;
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+    len += 4;
+    if ((uint32_t)(oend - op) < len)
+      return -1;
+
+    // The part of the match in the dictionary, if any
+    if (offset > (uint32_t)(op - dst))
+    {
+      const uint8_t *match = dict + dictlen - (offset - (op - dst));
+      while (len && (match < dict + dictlen))
+      {
+        *op++ = *match++;
+        --len;
+      }
+    }
+
+    // Byte by byte, since the match may overlap the output
+    const uint8_t *match = op - offset;
+    while (len--)
+    {
+      *op++ = *match++;
+    }
+  }
+
+  return op - dst;
+}
+
 void bl_tx_resp(uint8_t cmd, uint8_t ec)
 {
-  CAN_TxHeaderTypeDef m;
-  m.IDE = CAN_ID_STD;
-  m.StdId = CANID_BOOTLOADER_RPLY + FLASH_VARS->board.id;
-  m.RTR = CAN_RTR_DATA;
-  m.DLC = 3;
-  uint8_t data[3];
-  data[0] = FLASH_VARS->board.id;
-  data[1] = cmd;
-  data[2] = ec;
-  uint32_t mailbox;
-  volatile HAL_StatusTypeDef s = HAL_CAN_AddTxMessage(&hcan, &m, data, &mailbox);
-  // Wait on TX message
-  // while (HAL_CAN_IsTxMessagePending(&hcan, mailbox));
-}
-
-// Runs before any other code. Checks for magic value in memory from before bootloader reset
-// and jumps to the app if it's present.
+  bl_tx_resp_data(cmd, ec, NULL, 0);
+}
+
+// Program the acceptance filters, so only bootloader frames for this board reach the CPU:
+// bank 0: dense data frames for this board -> FIFO 0
+// bank 1: dense data frames for this board's group, if it has one -> FIFO 0
+// bank 2: commands (CANID_BOOTLOADER_CMD and CANID_BOOTLOADER_GRP_CMD) -> FIFO 1
+void can_config_filters(void)
+{
+  CAN_FilterTypeDef sf;
+  sf.FilterMode = CAN_FILTERMODE_IDMASK;
+  sf.FilterScale = CAN_FILTERSCALE_32BIT;
+  sf.FilterFIFOAssignment = CAN_FILTER_FIFO0;
+  sf.SlaveStartFilterBank = 14;
+
+  // 32 bit filter layout: ID << 3 | IDE | RTR. Match the ID prefix, the group bit of the frame type and the address.
+  uint32_t mask = ((CANID_BL_DATA_EXT_MASK | (BL_DATA_GROUP << 16) | 0xFF00) << 3) | CAN_ID_EXT | CAN_RTR_REMOTE;
+  sf.FilterMaskIdHigh = mask >> 16;
+  sf.FilterMaskIdLow = mask & 0xFFFF;
+  for (uint32_t bank = 0; bank < 2; ++bank)
+  {
+    uint8_t addr = bank ? FLASH_VARS->board.group : FLASH_VARS->board.id;
+    uint32_t id = ((CANID_BL_DATA_EXT | ((bank ? BL_DATA_GROUP : 0) << 16) | (addr << 8)) << 3) | CAN_ID_EXT;
+    sf.FilterIdHigh = id >> 16;
+    sf.FilterIdLow = id & 0xFFFF;
+    sf.FilterBank = bank;
+    sf.FilterActivation = (bank && (addr == 0)) ? CAN_FILTER_DISABLE : CAN_FILTER_ENABLE;
+    if (HAL_CAN_ConfigFilter(&hcan, &sf) != HAL_OK)
+    {
+      Error_Handler();
+    }
+  }
+
+  // 16 bit list of 4 standard IDs: ID << 5 (IDE and RTR 0)
+  sf.FilterMode = CAN_FILTERMODE_IDLIST;
+  sf.FilterScale = CAN_FILTERSCALE_16BIT;
+  sf.FilterFIFOAssignment = CAN_FILTER_FIFO1;
+  sf.FilterIdHigh = CANID_BOOTLOADER_CMD << 5;
+  sf.FilterIdLow = CANID_BOOTLOADER_GRP_CMD << 5;
+  sf.FilterMaskIdHigh = CANID_BOOTLOADER_CMD << 5;
+  sf.FilterMaskIdLow = CANID_BOOTLOADER_GRP_CMD << 5;
+  sf.FilterBank = 2;
+  sf.FilterActivation = CAN_FILTER_ENABLE;
+  if (HAL_CAN_ConfigFilter(&hcan, &sf) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
+
+//-----------------------------------------------------------------------------
+//  Boot stage
+//-----------------------------------------------------------------------------
+// Page 0 holds only a short vector table and the code below, and the self-update never rewrites it. So however an
+// update ends, the board comes up far enough to finish it. The bootloader proper starts at page 1 with g_pfnVectors.
+// Nothing is set up yet, and the rest of the bootloader may be half copied, so this code calls nothing outside page 0.
+// The CPU stalls while flash is busy, which is fine here.
+
+BOOT_STAGE static void stage_flash_wait(void)
+{
+  while (FLASH->SR & FLASH_SR_BSY)
+    ;
+}
+
+// Copy a page of the image in the backup slot over the bootloader. Returns 0 once flash matches.
+BOOT_STAGE static uint8_t stage_copy_page(uint32_t page)
+{
+  volatile uint16_t *dst = (volatile uint16_t *)(FLASH_BASE + 4 * page * PAGE_SIZE);
+  const uint16_t *src = (const uint16_t *)(BACKUP_BASE + page * PAGE_SIZE);
+
+  FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+  FLASH->CR |= FLASH_CR_PER;
+  FLASH->AR = (uint32_t)dst;
+  FLASH->CR |= FLASH_CR_STRT;
+  stage_flash_wait();
+  FLASH->CR &= ~FLASH_CR_PER;
+
+  FLASH->CR |= FLASH_CR_PG;
+  for (uint32_t i = 0; i < 2 * PAGE_SIZE; ++i)
+  {
+    dst[i] = src[i];
+    stage_flash_wait();
+  }
+  FLASH->CR &= ~FLASH_CR_PG;
+
+  for (uint32_t i = 0; i < 2 * PAGE_SIZE; ++i)
+  {
+    if (dst[i] != src[i])
+      return 1;
+  }
+  return 0;
+}
+
+BOOT_STAGE static void stage_mark_done(volatile uint32_t *word)
+{
+  FLASH->CR |= FLASH_CR_PG;
+  ((volatile uint16_t *)word)[0] = 0;
+  stage_flash_wait();
+  ((volatile uint16_t *)word)[1] = 0;
+  stage_flash_wait();
+  FLASH->CR &= ~FLASH_CR_PG;
+}
+
+// Whether the app can run without a bootloader: it passed a full check and its vector table points into RAM and into
+// the app. Like app_looks_sane, which is outside page 0.
+BOOT_STAGE static uint8_t stage_app_sane(void)
+{
+  volatile const struct bl_vars_t *vars = FLASH_VARS;
+  uint32_t pages = vars->app.page_count;
+  uint32_t sp = APP_BASE[0];
+  uint32_t pc = APP_BASE[1];
+  return (vars->app.verified == APP_VERIFIED_VAL) && (pages > 0) && (pages <= PAGE_COUNT) && (sp > SRAM_BASE) &&
+         (sp <= RAM_END) && (pc & 1) && ((pc & ~1UL) >= (uint32_t)APP_BASE) &&
+         ((pc & ~1UL) < (uint32_t)(APP_BASE + pages * PAGE_SIZE));
+}
+
+// Start the app straight from the boot stage, for when the bootloader proper is half copied
+BOOT_STAGE __attribute__((noreturn)) static void stage_app_start(void)
+{
+  FLASH->CR |= FLASH_CR_LOCK;
+  SCB->VTOR = (uint32_t)APP_BASE;
+  asm volatile("msr msp, %0\n"
+               "bx %1\n" ::"r"(APP_BASE[0]),
+               "r"(APP_BASE[1])
+               :);
+  while (1)
+    ;
+}
+
+// Reset handler of the boot stage. Finishes a self-update, then starts the bootloader proper.
+// A page that still doesn't verify after STAGE_COPY_TRIES copies (worn or protected flash) leaves the bootloader half
+// copied, and starting it would run a mix of two bootloaders. The boot stage starts the app instead if it looks sane, so
+// the board keeps working, and tries again on the next reset. Without such an app it keeps trying, and stops feeding the
+// watchdog so one started by the option bytes resets the board to try afresh. Either way only flash_bl (SWD) brings the
+// bootloader back.
+BOOT_STAGE __attribute__((noreturn)) void boot_stage_reset(void)
+{
+  volatile struct bl_update_t *update = BL_UPDATE;
+  if ((update->magic == BL_UPDATE_MAGIC_VAL) && (update->page_count <= BL_PAGES))
+  {
+    FLASH->KEYR = FLASH_KEY1;
+    FLASH->KEYR = FLASH_KEY2;
+    for (uint32_t p = 1; p < update->page_count; ++p)
+    {
+      // A page that doesn't verify is tried again
+      for (uint32_t tries = 0; update->done[p] != 0; ++tries)
+      {
+        if ((tries == STAGE_COPY_TRIES) && stage_app_sane())
+          stage_app_start();
+        if (tries < STAGE_COPY_TRIES)
+          IWDG->KR = 0xAAAA; // Only running if the option bytes start it
+        if (stage_copy_page(p) == 0)
+          stage_mark_done(&update->done[p]);
+      }
+    }
+    FLASH->CR |= FLASH_CR_LOCK;
+  }
+
+  asm volatile("msr msp, %0\n"
+               "bx %1\n" ::"r"(BL_MAIN_VECTORS[0]),
+               "r"(BL_MAIN_VECTORS[1])
+               :);
+  while (1)
+    ;
+}
+
+BOOT_STAGE static void boot_stage_halt(void)
+{
+  while (1)
+    ;
+}
+
+// Only faults can happen before the bootloader proper moves SCB->VTOR, everything else is off
+extern uint32_t _estack;
+__attribute__((section(".boot_stage_vectors"), used)) static void (*const boot_stage_vectors[4])(void) = {
+    (void (*)(void))&_estack,
+    boot_stage_reset,
+    boot_stage_halt, // NMI
+    boot_stage_halt, // HardFault
+};
+
+// Runs before any other code, even before .data and .bss are set up, so it may only use .noinit variables.
+// Checks for magic value in memory from before bootloader reset and jumps to the app if it's present.
+// The bootloader itself starts the app with app_start, this is the fallback for anything that sets the magic value.
 void PreSystemInit(void)
 {
-  // Check for magic value
-  if (*(MAGIC_ADDR) == MAGIC_VAL)
+  // Faults go to the bootloader's handlers from here on, not the boot stage's
+  SCB->VTOR = (uint32_t)g_pfnVectors;
+
+  // Check for magic value, also where apps for the first bootloaders set it
+  if ((*(MAGIC_ADDR) == MAGIC_VAL) || ((RCC->CSR & RCC_CSR_SFTRSTF) && (*LEGACY_MAGIC_ADDR == MAGIC_VAL)))
   {
     // Magic value is present. Reset it then jump to app.
     *(MAGIC_ADDR) = 0;
-    __set_MSP(*(APP_BASE));
+    *LEGACY_MAGIC_ADDR = 0;
+    // The flags of this reset would otherwise make the next boot look like a request for the bootloader
+    RCC->CSR |= RCC_CSR_RMVF;
+    uint32_t sp = *(APP_BASE);
     uint32_t app = *(APP_BASE + 1); // +1 = 4 bytes since uint32_t
-    asm("bx %0\n" ::"r"(app)
-        :);
+    // One asm block, so nothing is read from the old stack after the switch
+    asm volatile("msr msp, %0\n"
+                 "bx %1\n" ::"r"(sp),
+                 "r"(app)
+                 :);
   }
 }
 
+// Start the app straight from main(), without another reset. Everything the bootloader set up goes back to its reset
+// state, so the app starts as it would out of reset. Only the watchdog keeps running, it can't be stopped.
+static void app_start(void)
+{
+  // Put an image that hasn't reported healthy on trial, see app_health_update
+  if (FLASH_VARS->app.confirmed != APP_CONFIRMED_VAL)
+  {
+    if (boot_health.magic != HEALTH_MAGIC_VAL)
+    {
+      boot_health.crashes = 0;
+      boot_health.magic = HEALTH_MAGIC_VAL;
+    }
+    boot_health.healthy = 0;
+  }
+
+  HAL_CAN_DeInit(&hcan); // Also disables the CAN interrupts
+  HAL_CRC_DeInit(&hcrc);
+  HAL_RCC_DeInit(); // Back to HSI. Restarts SysTick for the new clock (its timeouts need it), so stop that afterwards.
+  HAL_DeInit();     // Resets all APB peripherals
+  __disable_irq();
+  SysTick->CTRL = 0;
+  SysTick->LOAD = 0;
+  SysTick->VAL = 0;
+  RCC->AHBENR = RCC_AHBENR_SRAMEN | RCC_AHBENR_FLITFEN; // Reset values
+  RCC->APB1ENR = 0;
+  RCC->APB2ENR = 0;
+
+  // Nothing may be left enabled or pending for the app
+  for (uint32_t i = 0; i < sizeof(NVIC->ICER) / sizeof(NVIC->ICER[0]); ++i)
+  {
+    NVIC->ICER[i] = 0xFFFFFFFF;
+    NVIC->ICPR[i] = 0xFFFFFFFF;
+  }
+  SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk | SCB_ICSR_PENDSVCLR_Msk;
+
+  SCB->VTOR = (uint32_t)APP_BASE;
+  uint32_t sp = *(APP_BASE);
+  uint32_t app = *(APP_BASE + 1);
+  __set_PSP(sp);
+  __set_CONTROL(0); // Privileged, main stack
+  __ISB();
+  __enable_irq(); // Interrupts are enabled out of reset
+  asm volatile("msr msp, %0\n"
+               "bx %1\n" ::"r"(sp),
+               "r"(app)
+               :);
+}
+
+// Write the vars with the header of this bootloader's layout. Every vars write goes through here (or __vars_write), so
+// the next bootloader can tell the layout. Skipped if flash holds them already, like fls_wr.
+static uint8_t vars_write(struct bl_vars_t *vars)
+{
+  vars->hdr.magic = VARS_MAGIC_VAL;
+  vars->hdr.version = VARS_VERSION;
+  vars->hdr.size = sizeof(*vars);
+  return fls_wr(APP_BASE - PAGE_SIZE, (uint32_t *)vars, sizeof(*vars) / 4);
+}
+
+// Like vars_write, but always erases the page, which clears the swap tally and markers behind the vars. Flash has to be
+// unlocked.
+static uint8_t __vars_write(struct bl_vars_t *vars)
+{
+  vars->hdr.magic = VARS_MAGIC_VAL;
+  vars->hdr.version = VARS_VERSION;
+  vars->hdr.size = sizeof(*vars);
+  return __fls_wr(APP_BASE - PAGE_SIZE, (uint32_t *)vars, sizeof(*vars) / 4);
+}
+
+// Bring the vars to this bootloader's layout, so the board ID, settings and app survive bootloader updates. Vars with a
+// header are taken over as described at struct bl_vars_t, and those of version 1 bootloaders are converted. Only an
+// erased or unknown page starts from defaults. Rewriting the vars also clears the marker of a finished self-update.
+// A stage request and the progress of its swap (STAGE_REQ and SWAP_TALLY) are programmed back after the rewrite, since
+// app_stage_apply only runs after this. Returns 1 if the vars were rewritten.
+static uint8_t vars_migrate(void)
+{
+  volatile const struct bl_vars_t *cur = FLASH_VARS;
+  uint8_t rewrite = BL_UPDATE->magic == BL_UPDATE_MAGIC_VAL;
+  struct bl_vars_t vars = {0};
+  uint32_t keep = 0; // Words from SWAP_TALLY on to program back
+
+  if ((cur->hdr.magic == VARS_MAGIC_VAL) && (cur->hdr.size >= sizeof(struct vars_header_t)) && (cur->hdr.size % 4 == 0))
+  {
+    memcpy(&vars, (const void *)cur, cur->hdr.size < sizeof(vars) ? cur->hdr.size : sizeof(vars));
+    rewrite |= (cur->hdr.version != VARS_VERSION) || (cur->hdr.size != sizeof(vars));
+    keep = (volatile uint32_t *)(STAGE_REQ + 1) - SWAP_TALLY;
+  }
+  else
+  {
+    // Version 1 vars start with the app page count and CRC, followed by the build timestamp and the ID. The app still
+    // has to pass a full check before it starts.
+    struct bl_vars_v1_t v1 = *(volatile const struct bl_vars_v1_t *)FLASH_VARS;
+    if ((v1.bl_build_version >= 1000000000) && (v1.bl_build_version <= 0xFFFFFFFF))
+    {
+      if ((v1.page_count > 0) && (v1.page_count <= PAGE_COUNT))
+      {
+        vars.app.page_count = v1.page_count;
+        vars.app.crc = v1.crc;
+        vars.app.verified = APP_UNCHECKED_VAL;
+      }
+      vars.board.id = v1.id;
+    }
+    rewrite = 1;
+  }
+  if (!rewrite)
+    return 0;
+
+  memcpy(pagebuf[1], (const void *)SWAP_TALLY, 4 * keep);
+  HAL_FLASH_Unlock();
+  uint8_t r = __vars_write(&vars);
+  for (uint32_t i = 0; !r && (i < keep); ++i)
+  {
+    if (pagebuf[1][i] != 0xFFFFFFFF)
+      r = fls_prog((const uint32_t *)&SWAP_TALLY[i], &pagebuf[1][i], 1);
+  }
+  HAL_FLASH_Lock();
+  if (r || (memcmp((const void *)FLASH_VARS, &vars, sizeof(vars)) != 0))
+  {
+    Error_Handler();
+  }
+  return 1;
+}
+
+// Check the app against the CRC stored by BL_CMD_WRITE_CRC
+static uint8_t app_valid(void)
+{
+  if ((FLASH_VARS->app.page_count == 0) || (FLASH_VARS->app.page_count > PAGE_COUNT))
+    return 0;
+  uint32_t crc = crc_calc((uint32_t *)APP_BASE, FLASH_VARS->app.page_count * PAGE_SIZE);
+  return crc == FLASH_VARS->app.crc;
+}
+
+// Quick check for boots between full CRC checks: the image was verified and its vector table points into RAM
+// (initial stack) and into the app (reset handler, in Thumb mode).
+static uint8_t app_looks_sane(void)
+{
+  uint32_t pages = FLASH_VARS->app.page_count;
+  if ((FLASH_VARS->app.verified != APP_VERIFIED_VAL) || (pages == 0) || (pages > PAGE_COUNT))
+    return 0;
+  uint32_t sp = APP_BASE[0];
+  uint32_t pc = APP_BASE[1];
+  return (sp > SRAM_BASE) && (sp <= RAM_END) && ((sp & 3) == 0) && (pc & 1) &&
+         ((pc & ~1UL) >= (uint32_t)APP_BASE) && ((pc & ~1UL) < (uint32_t)(APP_BASE + pages * PAGE_SIZE));
+}
+
+// Program a word of one of the tallies (or the verified mark) to 0, which needs no erase
+static void tally_mark(volatile const uint32_t *word)
+{
+  HAL_FLASH_Unlock();
+  fls_prog((const uint32_t *)word, &zero_word, 1);
+  HAL_FLASH_Lock();
+}
+
+// Decide whether the app can be started. Only every crc_interval boots (and after a watchdog reset) is the whole
+// image checked against its CRC. The boots in between only run app_looks_sane, so boot time doesn't depend on the app
+// size. Every boot adds a word to the boot tally. The vars page holds the only copy of the board data, so it is never
+// erased here. The tally has a page of its own instead, which a passing full check erases once it has no room for
+// another interval.
+static uint8_t app_check(void)
+{
+  uint32_t interval = FLASH_VARS->board.crc_interval ? FLASH_VARS->board.crc_interval : CRC_INTERVAL_DEFAULT;
+  if (interval > CRC_INTERVAL_MAX)
+    interval = CRC_INTERVAL_MAX;
+  uint32_t boots = 0;
+  while ((boots < BOOT_TALLY_SIZE) && (BOOT_TALLY[boots] != 0xFFFFFFFF))
+    ++boots;
+  if (boots < BOOT_TALLY_SIZE)
+    tally_mark(&BOOT_TALLY[boots]);
+
+  if (!(reset_csr & RCC_CSR_IWDGRSTF) && (boots < BOOT_TALLY_SIZE) && ((boots + 1) % interval != 0) &&
+      app_looks_sane())
+    return 1;
+
+  // Full check. A failed one clears the verified mark, which needs no erase either. A passing one sets the mark of an
+  // image still unchecked (swapped in or rolled back). One cleared to 0 is left to the next Write CRC, so such a board
+  // runs the full check on every boot.
+  if (!app_valid())
+  {
+    if (FLASH_VARS->app.verified != 0)
+      tally_mark(&FLASH_VARS->app.verified);
+    return 0;
+  }
+  if (FLASH_VARS->app.verified == APP_UNCHECKED_VAL)
+  {
+    HAL_FLASH_Unlock();
+    fls_prog((const uint32_t *)&FLASH_VARS->app.verified, &APP_VERIFIED_VAL, 1);
+    HAL_FLASH_Lock();
+  }
+  if (boots + interval >= BOOT_TALLY_SIZE)
+  {
+    HAL_FLASH_Unlock();
+    fls_erase((const uint32_t *)BOOT_TALLY);
+    HAL_FLASH_Lock();
+  }
+  return 1;
+}
+
+// Keep the crash record up to date with the reset that just happened. A record the app left gets the reset reason. A
+// watchdog reset without one means the app hung, so record that. After power loss RAM holds nothing worth keeping.
+// Returns whether the app crashed (left a new record or hung).
+static uint8_t crash_record_update(uint32_t csr)
+{
+  if (csr & RCC_CSR_PORRSTF)
+  {
+    crash_record.magic = 0;
+    return 0;
+  }
+  if ((crash_record.magic == CRASH_MAGIC_VAL) && (crash_record.reset_csr == 0))
+  {
+    crash_record.reset_csr = csr;
+    return 1;
+  }
+  if (csr & (RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF))
+  {
+    if (crash_record.magic != CRASH_MAGIC_VAL) // Keep the first record until it is read
+    {
+      memset(&crash_record, 0, sizeof(crash_record));
+      crash_record.reset_csr = csr;
+      crash_record.magic = CRASH_MAGIC_VAL;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// Copy the backup slot over the app. The app's verified mark is cleared first, so an interrupted copy is caught by the
+// full CRC check.
+static void app_rollback(void)
+{
+  struct bl_vars_t vars = *FLASH_VARS;
+  uint32_t pages = vars.backup.page_count;
+  if ((pages == 0) || (pages > BACKUP_PAGES))
+    return; // Nothing to go back to
+  if (crc_calc(BACKUP_BASE, pages * PAGE_SIZE) != vars.backup.crc)
+    return;
+
+  if (FLASH_VARS->app.verified != 0)
+  {
+    HAL_FLASH_Unlock();
+    fls_prog((const uint32_t *)&FLASH_VARS->app.verified, &zero_word, 1);
+    HAL_FLASH_Lock();
+  }
+  for (uint32_t p = 0; p < pages; ++p)
+  {
+    HAL_IWDG_Refresh(&hiwdg); // A page takes about 40 ms
+    if (fls_wr(APP_BASE + p * PAGE_SIZE, BACKUP_BASE + p * PAGE_SIZE, PAGE_SIZE))
+      return;
+  }
+
+  vars.app.page_count = pages;
+  vars.app.crc = vars.backup.crc;
+  vars.app.verified = APP_UNCHECKED_VAL; // Checked in full before it starts, which sets the mark
+  vars.app.confirmed = APP_CONFIRMED_VAL;
+  vars_write(&vars);
+}
+
+// Install an image the app staged in the backup slot by swapping the slots, so the app that staged it becomes the
+// backup. Each page goes app -> RAM, staged -> app, RAM -> backup. The SWAP_TALLY words before and after writing the
+// app page and after writing the backup page let a swap cut short by a reset carry on where it stopped. The old copy of
+// a page caught in the middle is lost, which the CRC check of the backup catches at the end.
+static void app_stage_apply(void)
+{
+  volatile struct stage_req_t *req = STAGE_REQ;
+  if (req->open == 0xFFFFFFFF)
+    return; // Nothing staged
+
+  struct bl_vars_t vars = *FLASH_VARS;
+  uint32_t pages = req->page_count;
+  uint8_t started = (SWAP_TALLY[0] == 0);
+  if (!started && !((req->ready == STAGE_READY_VAL) && (pages > 0) && (pages <= BACKUP_PAGES) &&
+                    (crc_calc(BACKUP_BASE, pages * PAGE_SIZE) == req->crc)))
+  {
+    // Staging stopped halfway or went wrong. The backup is partly overwritten either way. The vars may not change, so
+    // erase the page in any case to clear the stage request.
+    vars.backup.page_count = 0;
+    HAL_FLASH_Unlock();
+    __vars_write(&vars);
+    HAL_FLASH_Lock();
+    return;
+  }
+
+  uint32_t old_pages = vars.app.page_count;
+  if (old_pages > BACKUP_PAGES)
+    old_pages = 0; // Overlapped the staged image, nothing left to keep
+  // The app that staged the image is only worth keeping if it reported healthy
+  uint8_t keep_old = (vars.app.confirmed == APP_CONFIRMED_VAL) ||
+                     ((boot_health.magic == HEALTH_MAGIC_VAL) && (boot_health.healthy == APP_HEALTHY_VAL));
+  boot_health.magic = 0;
+
+  if (!started && (FLASH_VARS->app.verified != 0))
+    tally_mark(&FLASH_VARS->app.verified);
+  for (uint32_t p = 0; p < (pages > old_pages ? pages : old_pages); ++p)
+  {
+    volatile uint32_t *tally = SWAP_TALLY + 3 * p;
+    const uint32_t *app = APP_BASE + p * PAGE_SIZE;
+    const uint32_t *backup = BACKUP_BASE + p * PAGE_SIZE;
+    HAL_IWDG_Refresh(&hiwdg); // A page takes about 80 ms
+    if (tally[2] == 0)
+      continue;
+    if (tally[0] != 0)
+    {
+      memcpy(pagebuf[0], app, 4 * PAGE_SIZE);
+      tally_mark(&tally[0]);
+      if (fls_wr(app, backup, PAGE_SIZE))
+        return; // Try again on the next boot, the app doesn't pass its check like this
+      tally_mark(&tally[1]);
+      if (fls_wr(backup, pagebuf[0], PAGE_SIZE))
+        return;
+    }
+    else if (tally[1] != 0)
+    {
+      // Cut short while writing the app page. The staged page is still there.
+      if (fls_wr(app, backup, PAGE_SIZE))
+        return;
+      tally_mark(&tally[1]);
+    }
+    tally_mark(&tally[2]);
+  }
+
+  vars.backup.page_count = 0;
+  if (keep_old && (old_pages > 0) && (crc_calc(BACKUP_BASE, old_pages * PAGE_SIZE) == vars.app.crc))
+  {
+    vars.backup.page_count = old_pages;
+    vars.backup.crc = vars.app.crc;
+  }
+  vars.app.page_count = pages;
+  vars.app.crc = req->crc;
+  vars.app.verified = APP_UNCHECKED_VAL; // Checked in full before it starts, which sets the mark
+  vars.app.confirmed = 0;
+  // Erases the page even if the vars stay the same (the running image staged again), to clear the stage request and
+  // tally
+  HAL_FLASH_Unlock();
+  __vars_write(&vars);
+  HAL_FLASH_Lock();
+}
+
+// Follow an image that hasn't reported healthy yet through its first boots (app_start puts it on trial). Once the app
+// calls bl_app_healthy, the image is confirmed, and the next update backs it up before erasing it. If it crashes
+// BOOT_ATTEMPTS times in a row instead, the backup is copied back over it. Resets that weren't crashes (such as
+// resetting into the bootloader) don't count, and a power-on starts a new trial.
+static void app_health_update(uint32_t csr, uint8_t crashed)
+{
+  if ((csr & RCC_CSR_PORRSTF) || (boot_health.magic != HEALTH_MAGIC_VAL))
+  {
+    boot_health.magic = 0;
+    return;
+  }
+  if (boot_health.healthy == APP_HEALTHY_VAL)
+  {
+    boot_health.magic = 0;
+    if (FLASH_VARS->app.confirmed != APP_CONFIRMED_VAL)
+    {
+      struct bl_vars_t vars = *FLASH_VARS;
+      vars.app.confirmed = APP_CONFIRMED_VAL;
+      vars_write(&vars);
+    }
+  }
+  else if (crashed && (++boot_health.crashes >= BOOT_ATTEMPTS))
+  {
+    boot_health.magic = 0;
+    app_rollback();
+  }
+}
+
+// How long to listen for the flasher before starting the app, depending on why the MCU was reset. 0 = don't listen.
+// Reset from the bootloader. Whatever of its .bss sits at LEGACY_MAGIC_ADDR mustn't be taken for the magic value.
+static void bl_reset(void)
+{
+  *LEGACY_MAGIC_ADDR = 0;
+  __DSB();
+  NVIC_SystemReset();
+}
+
+// Drop the words shared with the app if it didn't leave them alone, or after power-on when RAM holds nothing yet. Apps
+// linked for all of RAM clear shared_ram_abi with their .data and .bss.
+static void shared_ram_check(uint32_t csr)
+{
+  if ((csr & RCC_CSR_PORRSTF) || (shared_ram_abi != SHARED_RAM_ABI_VAL))
+  {
+    boot_flags.request = 0;
+    crash_record.magic = 0;
+    boot_health.magic = 0;
+  }
+  shared_ram_abi = SHARED_RAM_ABI_VAL;
+}
+
+// Apps that set the boot request get the long timeout. A software reset (apps that reset without setting the request,
+// and the bootloader itself when there is no valid app), a watchdog reset (a crashed app) and the reset pin (button
+// or debugger) get the startup window. A plain power-on starts the app right away unless a boot window is set.
+static uint32_t boot_listen_time(void)
+{
+  uint32_t csr = RCC->CSR;
+  __HAL_RCC_CLEAR_RESET_FLAGS();
+  reset_csr = csr;
+  shared_ram_check(csr);
+  app_stage_apply(); // Before anything but vars_migrate rewrites the vars page, which keeps the stage request
+  app_health_update(csr, crash_record_update(csr));
+  if (boot_flags.request == BOOT_REQUEST_VAL)
+  {
+    boot_flags.request = 0;
+    return NOCANRX_TO;
+  }
+  if (csr & (RCC_CSR_SFTRSTF | RCC_CSR_IWDGRSTF | RCC_CSR_WWDGRSTF))
+    return STARTUP_TO;
+  if ((csr & RCC_CSR_PINRSTF) && !(csr & RCC_CSR_PORRSTF))
+    return STARTUP_TO; // Power-on pulls the reset pin as well
+  return FLASH_VARS->board.boot_window;
+}
+
 //-----------------------------------------------------------------------------
 //  CAN msg processing
 //-----------------------------------------------------------------------------
 
+// Store a word in a receive buffer and record that it has been received
+static void buf_write(uint32_t *buf, uint32_t ofs, uint32_t word)
+{
+  if (buf == pagebuf[rxbuf])
+  {
+    if (ofs == page_run.ofs)
+    {
+      page_run.crc = crc_sw_word(page_run.crc, word);
+      ++page_run.ofs;
+    }
+    else if ((ofs > page_run.ofs) || (buf[ofs] != word))
+    {
+      page_run.ofs = PAGE_RUN_BROKEN; // A resent word that didn't change anything is fine
+    }
+  }
+  buf[ofs] = word;
+  rxmask[ofs / 32] |= 1UL << (ofs % 32);
+}
+
+// Start receiving pagebuf[rxbuf] from scratch, after a command used what was in it
+static void rxbuf_reset(void)
+{
+  memset(rxmask, 0, sizeof(rxmask));
+  page_run.ofs = 0;
+  page_run.crc = CRC_INIT;
+}
+
+// Run the loaded stub and reply with its return code and result. A stub can change flash behind the bootloader's
+// back, so the page CRCs it knows are dropped and the app is checked in full on the next boot.
+static void stub_run(uint32_t entry_ofs, uint32_t arg)
+{
+  if (FLASH_VARS->app.verified != 0)
+  {
+    HAL_FLASH_Unlock();
+    fls_prog((const uint32_t *)&FLASH_VARS->app.verified, &zero_word, 1);
+    HAL_FLASH_Lock();
+  }
+  memset(page_crcs.known, 0, sizeof(page_crcs.known));
+
+  struct stub_args_t args = {
+      .abi_version = STUB_ABI_VERSION,
+      .arg = arg,
+      .buf = pagebuf[rxbuf],
+      .buf_words = PAGE_SIZE,
+      .result = 0,
+      .erase = fls_erase,
+      .prog = fls_prog,
+  };
+  uint8_t (*entry)(struct stub_args_t *) = (uint8_t(*)(struct stub_args_t *))(((uint32_t)stub_ram + entry_ofs) | 1);
+  uint8_t rc = entry(&args);
+
+  // The stub may have used the buffer, and its run time doesn't count as silence from the host
+  rxbuf_reset();
+  lastcanrx = HAL_GetTick();
+  HAL_IWDG_Refresh(&hiwdg);
+
+  uint8_t resp[5];
+  resp[0] = rc;
+  memcpy(&resp[1], &args.result, sizeof(args.result));
+  bl_tx_resp_data(BL_CMD_RUN_STUB, BL_SUCCESS, resp, sizeof(resp));
+}
+
+// Start streaming count words from base + ofs. Replaces a read in progress. The data frames are the reply to cmd,
+// and read_job_step ends them with the CRC.
+static void read_job_start(uint8_t cmd, const uint32_t *base, uint16_t ofs, uint16_t count)
+{
+  read_job.cmd = cmd;
+  read_job.base = base;
+  read_job.ofs = ofs;
+  read_job.end = ofs + count;
+  read_job.frame = 0;
+  read_job.limit = READ_WINDOW;
+  read_job.crc = CRC_INIT;
+  read_job.busy = 1;
+}
+
+// Whether the bootloader image in the backup slot can replace this one: it has the same boot stage (page 0 is never
+// rewritten), and the vector table of the bootloader proper points into RAM and into the image
+static uint8_t bl_image_fits(uint32_t pages)
+{
+  const uint32_t *vectors = BACKUP_BASE + PAGE_SIZE;
+  uint32_t sp = vectors[0];
+  uint32_t pc = vectors[1] & ~1UL;
+  return (0 == memcmp(BACKUP_BASE, (const uint32_t *)FLASH_BASE, 4 * PAGE_SIZE)) && (sp > SRAM_BASE) &&
+         (sp <= RAM_END) && (vectors[1] & 1) && (pc >= (uint32_t)BL_MAIN_VECTORS) &&
+         (pc < FLASH_BASE + 4 * pages * PAGE_SIZE);
+}
+
+// Handle a dense data frame (extended ID, 8 bytes of payload)
+void process_data_frame(CAN_RxHeaderTypeDef *msg, uint8_t data[])
+{
+  uint8_t type = BL_EXT_TYPE(msg->ExtId);
+  uint8_t addr = (type & BL_DATA_GROUP) ? FLASH_VARS->board.group : FLASH_VARS->board.id;
+  if ((BL_EXT_BRD(msg->ExtId) != addr) || (msg->DLC != 8))
+    return;
+  if ((type & BL_DATA_GROUP) && (addr == 0))
+    return; // Not in a group
+  message_received = 1;
+  lastcanrx = HAL_GetTick();
+
+  uint32_t *buf;
+  switch (type & ~BL_DATA_GROUP)
+  {
+  case BL_DATA_PAGE:
+    buf = pagebuf[rxbuf];
+    break;
+  case BL_DATA_ZBUF:
+    buf = zbuf;
+    break;
+  default:
+    return;
+  }
+
+  uint32_t ofs = BL_EXT_OFS(msg->ExtId);
+  if (ofs + 1 < PAGE_SIZE)
+  {
+    uint32_t words[2];
+    memcpy(words, data, 8);
+    buf_write(buf, ofs, words[0]);
+    buf_write(buf, ofs + 1, words[1]);
+  }
+  else
+  {
+    bl_tx_resp(BL_CMD_STREAM_BUF, BL_ERR_INVALID_OFFSET); // invalid ofs
+  }
+}
+
 void process_can_msg(CAN_RxHeaderTypeDef *msg, uint8_t data[])
 {
-  static uint32_t pagebuf[PAGE_SIZE];
+  if ((msg->IDE == CAN_ID_EXT) && ((msg->ExtId & CANID_BL_DATA_EXT_MASK) == CANID_BL_DATA_EXT))
+  {
+    process_data_frame(msg, data);
+    return;
+  }
 
-  if ((msg->StdId == CANID_BOOTLOADER_CMD) && (msg->DLC == 8))
+  uint8_t group_cmd = (msg->IDE == CAN_ID_STD) && (msg->StdId == CANID_BOOTLOADER_GRP_CMD);
+  if ((((msg->IDE == CAN_ID_STD) && (msg->StdId == CANID_BOOTLOADER_CMD)) || group_cmd) && (msg->DLC == 8))
   {
     struct bl_cmd_t blc;
     memcpy(&blc, data, 8);
 
-    // All boards respond to ping command
-    if (blc.cmd == BL_CMD_PING)
-    {                                  // ping command - just respond with OK
-      bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
-      return;
+    if (group_cmd)
+    {
+      // Only page transfer commands and the bit rate switch can be sent to a group. Every member replies with its own
+      // board ID.
+      if ((FLASH_VARS->board.group == 0) || (blc.brd != FLASH_VARS->board.group))
+        return;
+      if ((blc.cmd != BL_CMD_WRITE_BUF) && (blc.cmd != BL_CMD_STREAM_BUF) &&
+          (blc.cmd != BL_CMD_BUF_STATUS) && (blc.cmd != BL_CMD_DECOMPRESS) && (blc.cmd != BL_CMD_WRITE_PAGE) &&
+          (blc.cmd != BL_CMD_BITRATE))
+        return;
     }
+    else
+    {
+      // All boards respond to ping command
+      if (blc.cmd == BL_CMD_PING)
+      { // ping command - respond with OK and the capability flags
+        uint32_t caps = BL_CAPS;
+        bl_tx_resp_data(blc.cmd, BL_SUCCESS, (uint8_t *)&caps, sizeof(caps));
+        return;
+      }
 
-    if (blc.brd != FLASH_VARS->board.id)
-      return;
+      if (blc.brd != FLASH_VARS->board.id)
+        return;
+    }
     message_received = 1;
     lastcanrx = HAL_GetTick();
 
+    // Commands that read or write flash or use the CRC unit have to wait for the page being programmed and the app CRC
+    if ((fls_job.busy || crc_job.busy) &&
+        ((blc.cmd == BL_CMD_WRITE_PAGE) || (blc.cmd == BL_CMD_WRITE_CRC) || (blc.cmd == BL_CMD_SET_ID) ||
+         (blc.cmd == BL_CMD_SET_GROUP) || (blc.cmd == BL_CMD_PAGE_CRC) || (blc.cmd == BL_CMD_APP_INFO) ||
+         (blc.cmd == BL_CMD_SET_BOOT_WINDOW) || (blc.cmd == BL_CMD_SET_CRC_INTERVAL) || (blc.cmd == BL_CMD_READ_MEM) ||
+         (blc.cmd == BL_CMD_LOAD_STUB) || (blc.cmd == BL_CMD_RUN_STUB) || (blc.cmd == BL_CMD_UPDATE_BL) ||
+         ((blc.cmd == BL_CMD_DECOMPRESS) && (blc.par2 > 0))))
+    {
+      bl_tx_resp(blc.cmd, BL_ERR_BUSY);
+      return;
+    }
+
+    // A page failed to program since the last WRITE_PAGE. This command is not carried out, so the host resends it.
+    if ((fls_job.err_page != BL_NO_PAGE) && ((blc.cmd == BL_CMD_WRITE_PAGE) || (blc.cmd == BL_CMD_WRITE_CRC)))
+    {
+      uint8_t page = fls_job.err_page;
+      fls_job.err_page = BL_NO_PAGE;
+      bl_tx_resp_data(blc.cmd, BL_ERR_FLASH_WRITE, &page, sizeof(page));
+      return;
+    }
+
     switch (blc.cmd)
     {
-    case BL_CMD_WRITE_BUF: // write buffer command, par1 = offset, par2 =data
+    case BL_CMD_WRITE_BUF:  // write buffer command, par1 = offset, par2 =data
+    case BL_CMD_STREAM_BUF: // same, but only replies on error. WRITE_PAGE's CRC check catches lost frames.
       if (blc.par1 < PAGE_SIZE)
       {
-        pagebuf[blc.par1] = blc.par2;
+        buf_write(pagebuf[rxbuf], blc.par1, blc.par2);
+        if (blc.cmd == BL_CMD_WRITE_BUF)
+        {
+          bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
+        }
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // invalid ofs
+      }
+      break;
+
+    case BL_CMD_BUF_STATUS: // buffer status command, par1 = first word offset
+      if (blc.par1 < PAGE_SIZE)
+      {
+        // Reply with the offset asked about, so a late reply can't be taken for a later query,
+        // and a bitmap of the missing words from par1 to par1 + 31
+        uint8_t status[5];
+        status[0] = blc.par1;
+        uint32_t bitmap = 0;
+        for (uint32_t i = 0; i < 32; ++i)
+        {
+          uint32_t w = blc.par1 + i;
+          if ((w < PAGE_SIZE) && !(rxmask[w / 32] & (1UL << (w % 32))))
+          {
+            bitmap |= 1UL << i;
+          }
+        }
+        memcpy(&status[1], &bitmap, sizeof(bitmap));
+        bl_tx_resp_data(blc.cmd, BL_SUCCESS, status, sizeof(status));
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // invalid ofs
+      }
+      break;
+
+    case BL_CMD_DECOMPRESS: // decompress command, par1 = compressed length in bytes, par2 = dictionary length in bytes
+      // The dictionary is the start of the app region as it is in flash right now, so a page can be sent as a delta
+      // against the installed app. It is up to the host to only reference pages it knows the contents of.
+      if ((blc.par1 <= sizeof(zbuf)) && (blc.par2 <= PAGE_COUNT * PAGE_SIZE * 4))
+      {
+        // The block must decompress to exactly one page. WRITE_PAGE's CRC check still applies.
+        int32_t len = lz4_decompress((uint8_t *)zbuf, blc.par1, (uint8_t *)pagebuf[rxbuf], sizeof(pagebuf[rxbuf]),
+                                     (const uint8_t *)APP_BASE, blc.par2);
+        page_run.ofs = PAGE_RUN_BROKEN;
+        if (len == sizeof(pagebuf[rxbuf]))
+        {
+          bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
+        }
+        else
+        {
+          bl_tx_resp(blc.cmd, BL_ERR_DECOMPRESS); // malformed block
+        }
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // too long
+      }
+      break;
+
+    case BL_CMD_WRITE_PAGE: // write page command, par1 = page number (backup slot from BACKUP_FIRST_PAGE), par2 = crc
+      if (blc.par1 < PAGE_COUNT)
+      {
+        // Words that all arrived in order are already in the running CRC
+        uint32_t crc = (page_run.ofs == PAGE_SIZE) ? page_run.crc : crc_calc(pagebuf[rxbuf], PAGE_SIZE);
+
+        // The buffer is consumed either way. The next page starts with nothing received.
+        rxbuf_reset();
+
+        if (crc == blc.par2)
+        {
+          // Hand the buffer to the main loop and receive the next page into the other one.
+          // Programming errors are reported by the next WRITE_PAGE or WRITE_CRC.
+          fls_job.page = blc.par1;
+          fls_job.buf = rxbuf;
+          fls_job.crc = crc;
+          fls_job.erased = 0;
+          fls_job.ofs = 0;
+          fls_job.busy = 1;
+          rxbuf ^= 1;
+          bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
+        }
+        else
+        {
+          bl_tx_resp(blc.cmd, BL_ERR_INVALID_CRC); // invalid CRC
+        }
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_PAGE_NUM); // invalid pagenum
+      }
+      break;
+
+    case BL_CMD_WRITE_CRC: // write CRC command, par1 = number of pages, par2 = crc
+      if (blc.par1 <= PAGE_COUNT)
+      {
+        // Flash is only read for pages whose CRC isn't known from PAGE_CRC or programming them
+        uint32_t crc = app_crc_from_pages(blc.par1);
+        if (crc == blc.par2)
+        {
+          // New flash data to store
+          struct bl_vars_t vars = *FLASH_VARS;
+          // Update app data
+          vars.app.page_count = blc.par1;
+          vars.app.crc = blc.par2;
+          vars.app.verified = APP_VERIFIED_VAL; // Boots can skip the full CRC for a while
+          // A new image has to report healthy before it is backed up. Rewriting the same image changes nothing.
+          if ((blc.par1 == FLASH_VARS->app.page_count) && (blc.par2 == FLASH_VARS->app.crc))
+            vars.app.confirmed = FLASH_VARS->app.confirmed;
+          else
+            vars.app.confirmed = 0;
+
+          // Keep board data and the backup, unless the app reaches into the backup slot
+          if (blc.par1 > BACKUP_FIRST_PAGE)
+            vars.backup.page_count = 0;
+
+          uint8_t r = vars_write(&vars);
+          if (r)
+          {
+            bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE); // verify failed
+          }
+          else
+          {
+            bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
+          }
+        }
+        else
+        {
+          bl_tx_resp(blc.cmd, BL_ERR_INVALID_CRC); // invalid CRC
+        }
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, 1); // invalid number of pages
+      }
+      break;
+
+    case BL_CMD_SET_ID: // Write ID command, par1 = new ID
+      if (blc.par1 < 255 )
+      {
+        // Read data from flash
+        struct bl_vars_t vars = *FLASH_VARS;
+        // Update board ID
+        vars.board.id = (uint8_t)blc.par1;
+
+        uint8_t r = vars_write(&vars);
+        if (r)
+        {
+          bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE); // verify failed
+        }
+        else
+        {
+          can_config_filters(); // Data frames are filtered by board ID and group
+          bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
+        }
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_PAGE_NUM);
+      }
+      break;
+
+    case BL_CMD_PAGE_CRC: // page CRC command, par1 = first page, par2 = number of pages
+      if ((blc.par2 > 0) && (blc.par2 <= PAGE_COUNT) && (blc.par1 + blc.par2 <= PAGE_COUNT))
+      {
+        // The main loop sends the replies. A new PAGE_CRC replaces one in progress.
+        page_crc_job.page = blc.par1;
+        page_crc_job.end = blc.par1 + blc.par2;
+        page_crc_job.busy = 1;
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_PAGE_NUM); // invalid pagenum
+      }
+      break;
+
+    case BL_CMD_APP_INFO: // app info command, no parameters
+      // Reply with the page count and CRC of the installed app, and whether flash still matches that CRC
+      if ((FLASH_VARS->app.page_count > 0) && (FLASH_VARS->app.page_count <= PAGE_COUNT))
+      {
+        // Replied to by crc_job_finish
+        crc_job.cmd = blc.cmd;
+        crc_job.page_count = FLASH_VARS->app.page_count;
+        crc_job.crc = FLASH_VARS->app.crc;
+        crc_job.busy = 1;
+        crc_dma_start((uint32_t *)APP_BASE, crc_job.page_count * PAGE_SIZE);
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_PAGE_NUM); // no app installed
+      }
+      break;
+
+    case BL_CMD_STATS: // statistics command, par1 = 1 to clear the counters after reading them, par2 = 0 RX / 1 TX
+    {
+      uint8_t resp[5] = {0};
+      if (blc.par2 == 0)
+      {
+        uint16_t drops = rx_stats.ring_drops;
+        uint16_t overruns = rx_stats.fifo_overruns;
+        resp[0] = rx_stats.ring_max;
+        memcpy(&resp[1], &drops, sizeof(drops));
+        memcpy(&resp[3], &overruns, sizeof(overruns));
+        if (blc.par1 == 1)
+        {
+          rx_stats.ring_max = 0;
+          rx_stats.ring_drops = 0;
+          rx_stats.fifo_overruns = 0;
+        }
+      }
+      else
+      {
+        uint16_t drops = tx_stats.ring_drops;
+        resp[0] = tx_stats.ring_max;
+        memcpy(&resp[1], &drops, sizeof(drops));
+        if (blc.par1 == 1)
+        {
+          tx_stats.ring_max = 0;
+          tx_stats.ring_drops = 0;
+        }
+      }
+      bl_tx_resp_data(blc.cmd, BL_SUCCESS, resp, sizeof(resp));
+      break;
+    }
+
+    case BL_CMD_BITRATE: // bit rate command, par1 = bit rate (BL_BITRATE_*). Replies at the old bit rate.
+      if (blc.par1 < BL_BITRATE_COUNT)
+      {
         bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
+        bitrate.pending = 1;
+        bitrate.rate = blc.par1;
+        bitrate.since = HAL_GetTick();
       }
       else
       {
-        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // invalid ofs
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_BITRATE);
       }
       break;
 
-    case BL_CMD_WRITE_PAGE: // write page command, par1 = page number, par2 = crc
-      if (blc.par1 < PAGE_COUNT)
+    case BL_CMD_READ_MEM: // read command, par1 = first word from READ_BASE, par2 = number of words
+      if ((blc.par2 > 0) && (blc.par2 <= READ_SIZE) && (blc.par1 + blc.par2 <= READ_SIZE))
+      {
+        read_job_start(blc.cmd, READ_BASE, blc.par1, blc.par2);
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // outside the settings page and app
+      }
+      break;
+
+    case BL_CMD_LOAD_STUB: // load stub command, par1 = length in words, par2 = crc of that much of the page buffer
+      if ((blc.par1 > 0) && (blc.par1 <= STUB_SIZE))
       {
-        uint32_t crc = HAL_CRC_Calculate(&hcrc, pagebuf, PAGE_SIZE);
+        // Same CRC as WRITE_PAGE, from the running CRC if the words arrived in order
+        uint32_t crc = (page_run.ofs == blc.par1) ? page_run.crc : crc_calc(pagebuf[rxbuf], blc.par1);
+        // The buffer is consumed either way, like with WRITE_PAGE
+        rxbuf_reset();
         if (crc == blc.par2)
         {
-          uint32_t pgofs = blc.par1 * PAGE_SIZE;
-          uint8_t r = fls_wr(APP_BASE + pgofs, pagebuf, PAGE_SIZE);
-          if (r)
-          {
-            bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE); // verify failed
-          }
-          else
-          {
-            bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
-          }
+          memcpy(stub_ram, pagebuf[rxbuf], 4 * blc.par1);
+          stub_len = blc.par1;
+          // Stubs that aren't position independent can be linked for this address
+          uint8_t resp[5] = {0};
+          uint32_t addr = (uint32_t)stub_ram;
+          memcpy(&resp[1], &addr, sizeof(addr));
+          bl_tx_resp_data(blc.cmd, BL_SUCCESS, resp, sizeof(resp));
         }
         else
         {
+          stub_len = 0;
           bl_tx_resp(blc.cmd, BL_ERR_INVALID_CRC); // invalid CRC
         }
       }
       else
       {
-        bl_tx_resp(blc.cmd, BL_ERR_INVALID_PAGE_NUM); // invalid pagenum
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // doesn't fit into stub RAM
       }
       break;
 
-    case BL_CMD_WRITE_CRC: // write CRC command, par1 = number of pages, par2 = crc
-      if (blc.par1 <= PAGE_COUNT)
+    case BL_CMD_RUN_STUB: // run stub command, par1 = entry point as a byte offset into the stub, par2 = argument
+      if ((stub_len > 0) && (blc.par1 % 2 == 0) && (blc.par1 < 4 * stub_len))
       {
-        uint32_t crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)APP_BASE, blc.par1 * PAGE_SIZE);
-        if (crc == blc.par2)
+        stub_run(blc.par1, blc.par2); // Replies when the stub returns
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // no stub, or entry point outside of it
+      }
+      break;
+
+    case BL_CMD_UPDATE_BL: // bootloader update command, par1 = page count, par2 = CRC of the image in the backup slot
+      if ((blc.par1 < 2) || (blc.par1 > BL_PAGES))
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_PAGE_NUM);
+      }
+      else if (crc_calc(BACKUP_BASE, blc.par1 * PAGE_SIZE) != blc.par2)
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_CRC);
+      }
+      else if (!bl_image_fits(blc.par1))
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_BOOT_STAGE);
+      }
+      else
+      {
+        // Leave the marker for the boot stage (page count, then the magic value) and reset into it once the reply is out
+        const uint32_t marker[2] = {blc.par1, BL_UPDATE_MAGIC_VAL};
+        uint8_t r = 0;
+        if ((BL_UPDATE->page_count != 0xFFFFFFFF) || (BL_UPDATE->magic != 0xFFFFFFFF))
         {
-          // New flash data to store
-          struct bl_vars_t vars;
-          // Update app data
-          vars.app.page_count = blc.par1;
-          vars.app.crc = blc.par2;
+          struct bl_vars_t vars = *FLASH_VARS; // Rewriting the vars clears an old marker
+          HAL_FLASH_Unlock();
+          r = __vars_write(&vars);
+          HAL_FLASH_Lock();
+        }
+        if (!r)
+        {
+          HAL_FLASH_Unlock();
+          r = fls_prog((const uint32_t *)BL_UPDATE, marker, 2);
+          HAL_FLASH_Lock();
+        }
+        if (r)
+        {
+          bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE);
+        }
+        else
+        {
+          bl_tx_resp(blc.cmd, BL_SUCCESS);
+          bl_update.pending = 1;
+          bl_update.since = HAL_GetTick();
+        }
+      }
+      break;
 
-          // Keep board data
-          vars.board = FLASH_VARS->board;
+    case BL_CMD_READ_CRASH: // read crash record command, par1 = 1 to clear the record instead
+      if (blc.par1 == 1)
+      {
+        crash_record.magic = 0;
+        bl_tx_resp(blc.cmd, BL_SUCCESS);
+      }
+      else
+      {
+        // Sent whether or not there is a record. The host checks the magic value.
+        read_job_start(blc.cmd, (const uint32_t *)&crash_record, 0, sizeof(crash_record) / 4);
+      }
+      break;
 
-          uint8_t r = fls_wr(APP_BASE - PAGE_SIZE, (uint32_t *)&vars, sizeof(vars) / 4);
-          if (r)
-          {
-            bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE); // verify failed
-          }
-          else
-          {
-            bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
-          }
+    case BL_CMD_READ_CREDIT: // read credit command, par1 = frames the host has room for since READ_MEM. No reply.
+      if (blc.par1 > read_job.limit)
+      {
+        read_job.limit = blc.par1;
+      }
+      break;
+
+    case BL_CMD_SET_GROUP: // Write group command, par1 = new group (0 = none)
+      if (blc.par1 <= 255)
+      {
+        struct bl_vars_t vars = *FLASH_VARS;
+        vars.board.group = (uint8_t)blc.par1;
+
+        uint8_t r = vars_write(&vars);
+        if (r)
+        {
+          bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE); // verify failed
         }
         else
         {
-          bl_tx_resp(blc.cmd, 2); // invalid CRC
+          can_config_filters(); // Data frames are filtered by board ID and group
+          bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
         }
       }
       else
       {
-        bl_tx_resp(blc.cmd, 1); // invalid number of pages
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_ID);
       }
       break;
 
-    case BL_CMD_SET_ID: // Write ID command, par1 = new ID
-      if (blc.par1 < 255 )
+    case BL_CMD_SET_CRC_INTERVAL: // Write CRC interval command, par1 = boots between full app CRC checks
+      if (blc.par1 <= CRC_INTERVAL_MAX)
       {
-        // Read data from flash
         struct bl_vars_t vars = *FLASH_VARS;
-        // Update board ID
-        vars.board.id = (uint8_t)blc.par1;
+        vars.board.crc_interval = blc.par1;
 
-        uint8_t r = fls_wr(APP_BASE - PAGE_SIZE, (uint32_t *)&vars, sizeof(vars) / 4);
+        uint8_t r = vars_write(&vars);
         if (r)
         {
           bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE); // verify failed
@@ -309,19 +1806,367 @@ void process_can_msg(CAN_RxHeaderTypeDef *msg, uint8_t data[])
       }
       else
       {
-        bl_tx_resp(blc.cmd, BL_ERR_INVALID_PAGE_NUM);
+        bl_tx_resp(blc.cmd, BL_ERR_INVALID_OFFSET); // longer than CRC_INTERVAL_MAX
+      }
+      break;
+
+    case BL_CMD_SET_BOOT_WINDOW: // Write boot window command, par1 = milliseconds to listen after power-on (0 = none)
+    {
+      struct bl_vars_t vars = *FLASH_VARS;
+      vars.board.boot_window = blc.par1;
+
+      uint8_t r = vars_write(&vars);
+      if (r)
+      {
+        bl_tx_resp(blc.cmd, BL_ERR_FLASH_WRITE); // verify failed
+      }
+      else
+      {
+        bl_tx_resp(blc.cmd, BL_SUCCESS); // OK
       }
       break;
     }
+    }
+  }
+}
+
+// CAN RX FIFO 0 and 1 interrupt. Copies received frames into rx_ring. Everything else happens in the main loop, so the
+// FIFOs are emptied quickly even while a command is busy with flash.
+// Runs from RAM (see fls_erase) and only touches registers directly, since HAL code is in flash.
+// RF0R and RF1R have the same layout, so the FIFO 0 bit names are used for both.
+RAMFUNC void can_irq(void)
+{
+  for (uint32_t fifo = 0; fifo < 2; ++fifo)
+  {
+    volatile uint32_t *rfr = fifo ? &CAN1->RF1R : &CAN1->RF0R;
+    if (*rfr & CAN_RF0R_FOVR0)
+    {
+      *rfr = CAN_RF0R_FOVR0;
+      if (rx_stats.fifo_overruns < UINT16_MAX)
+        ++rx_stats.fifo_overruns;
+    }
+  }
+
+  while (1)
+  {
+    // Data frames (FIFO 0) first, so a command never overtakes data sent before it
+    uint32_t fifo;
+    if (CAN1->RF0R & CAN_RF0R_FMP0)
+      fifo = 0;
+    else if (CAN1->RF1R & CAN_RF1R_FMP1)
+      fifo = 1;
+    else
+      break;
+    volatile uint32_t *rfr = fifo ? &CAN1->RF1R : &CAN1->RF0R;
+    CAN_FIFOMailBox_TypeDef *mb = &CAN1->sFIFOMailBox[fifo];
+
+    uint8_t head = rx_ring.head;
+    uint8_t next = (head + 1) & (RX_RING_SIZE - 1);
+    if (next == rx_ring.tail)
+    {
+      // Ring full. The frame still has to come out of the FIFO.
+      *rfr = CAN_RF0R_RFOM0;
+      if (rx_stats.ring_drops < UINT16_MAX)
+        ++rx_stats.ring_drops;
+      continue;
+    }
+
+    struct can_frame_t *f = &rx_ring.frames[head];
+    uint32_t rir = mb->RIR;
+    uint32_t rdl = mb->RDLR;
+    uint32_t rdh = mb->RDHR;
+    f->ide = rir & CAN_RI0R_IDE; // Same bit as CAN_ID_EXT
+    f->id = (f->ide == CAN_ID_EXT) ? (rir >> CAN_RI0R_EXID_Pos) : (rir >> CAN_RI0R_STID_Pos);
+    f->dlc = mb->RDTR & CAN_RDT0R_DLC;
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+      f->data[i] = rdl >> (8 * i);
+      f->data[i + 4] = rdh >> (8 * i);
+    }
+    *rfr = CAN_RF0R_RFOM0; // Release the FIFO slot
+    __DMB();
+    rx_ring.head = next;
+
+    uint8_t used = (next - rx_ring.tail) & (RX_RING_SIZE - 1);
+    if (used > rx_stats.ring_max)
+      rx_stats.ring_max = used;
+  }
+}
+
+// CAN TX mailbox empty interrupt, also triggered by bl_tx_resp_data. Moves queued replies into free mailboxes.
+// With transmit FIFO priority enabled, the mailboxes send in the order they were filled, so replies keep their order.
+// Runs from RAM like can_irq.
+RAMFUNC void can_tx_irq(void)
+{
+  CAN1->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2;
+
+  while ((tx_ring.tail != tx_ring.head) && (CAN1->TSR & CAN_TSR_TME))
+  {
+    __DMB();
+    // CODE is the number of an empty mailbox
+    CAN_TxMailBox_TypeDef *mb = &CAN1->sTxMailBox[(CAN1->TSR & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos];
+    struct can_frame_t *f = &tx_ring.frames[tx_ring.tail];
+    uint32_t tdl = 0;
+    uint32_t tdh = 0;
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+      tdl |= (uint32_t)f->data[i] << (8 * i);
+      tdh |= (uint32_t)f->data[i + 4] << (8 * i);
+    }
+    mb->TDTR = f->dlc;
+    mb->TDLR = tdl;
+    mb->TDHR = tdh;
+    if (f->ide == CAN_ID_EXT)
+      mb->TIR = (f->id << CAN_TI0R_EXID_Pos) | CAN_TI0R_IDE | CAN_TI0R_TXRQ;
+    else
+      mb->TIR = (f->id << CAN_TI0R_STID_Pos) | CAN_TI0R_TXRQ;
+    __DMB();
+    tx_ring.tail = (tx_ring.tail + 1) & (TX_RING_SIZE - 1);
+  }
+}
+
+// Process the frames can_irq has queued
+static void rx_ring_process(void)
+{
+  while (rx_ring.tail != rx_ring.head)
+  {
+    __DMB();
+    struct can_frame_t *f = &rx_ring.frames[rx_ring.tail];
+    CAN_RxHeaderTypeDef msg = {0};
+    msg.IDE = f->ide;
+    msg.DLC = f->dlc;
+    if (f->ide == CAN_ID_EXT)
+      msg.ExtId = f->id;
+    else
+      msg.StdId = f->id;
+    process_can_msg(&msg, f->data);
+    // Only now is the slot free for can_irq again
+    __DMB();
+    rx_ring.tail = (rx_ring.tail + 1) & (RX_RING_SIZE - 1);
+    // A frame got through, so the bit rate works
+    bitrate.trial = 0;
+  }
+}
+
+// Reply to the APP_INFO command whose CRC the DMA has finished
+static void crc_job_finish(void)
+{
+  uint32_t crc = crc_dma_result();
+  crc_job.busy = 0;
+
+  uint8_t resp[5];
+  resp[0] = crc_job.page_count;
+  memcpy(&resp[1], &crc_job.crc, sizeof(crc_job.crc));
+  bl_tx_resp_data(crc_job.cmd, (crc == crc_job.crc) ? BL_SUCCESS : BL_ERR_INVALID_CRC, resp, sizeof(resp));
+}
+
+// Send the PAGE_CRC replies, one per page with the page number followed by the page CRC, as far as the TX queue has
+// room
+static void page_crc_job_step(void)
+{
+  while ((page_crc_job.page < page_crc_job.end) && !tx_ring_full())
+  {
+    uint32_t crc = page_crc_get(page_crc_job.page);
+    uint8_t resp[5];
+    resp[0] = page_crc_job.page;
+    memcpy(&resp[1], &crc, sizeof(crc));
+    bl_tx_resp_data(BL_CMD_PAGE_CRC, BL_SUCCESS, resp, sizeof(resp));
+    ++page_crc_job.page;
+  }
+  if (page_crc_job.page == page_crc_job.end)
+  {
+    page_crc_job.busy = 0;
+  }
+}
+
+// Queue as many read data frames as the TX queue and the host's credit allow. The last frame is followed by a
+// reply with the frame count and the CRC of the range, which keeps its place behind the data in the queue.
+static void read_job_step(void)
+{
+  while ((read_job.ofs < read_job.end) && (read_job.frame < read_job.limit) && !tx_ring_full())
+  {
+    uint32_t words[2];
+    uint32_t count = (read_job.end - read_job.ofs >= 2) ? 2 : 1;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      words[i] = read_job.base[read_job.ofs + i];
+      read_job.crc = crc_sw_word(read_job.crc, words[i]);
+    }
+
+    struct can_frame_t f;
+    f.id = CANID_BL_DATA_EXT | (BL_DATA_READ << 16) | (FLASH_VARS->board.id << 8) | (read_job.frame & 0xFF);
+    f.ide = CAN_ID_EXT;
+    f.dlc = 4 * count;
+    memcpy(f.data, words, 4 * count);
+    tx_ring_push(&f);
+
+    read_job.ofs += count;
+    ++read_job.frame;
+  }
+
+  if (read_job.ofs == read_job.end)
+  {
+    uint8_t resp[5];
+    resp[0] = read_job.frame & 0xFF;
+    memcpy(&resp[1], &read_job.crc, sizeof(read_job.crc));
+    bl_tx_resp_data(read_job.cmd, BL_SUCCESS, resp, sizeof(resp));
+    read_job.busy = 0;
+  }
+}
+
+// Whether the app in flash is one that reported healthy, fits into the backup slot and isn't in it yet
+static uint8_t backup_needed(void)
+{
+  volatile const struct bl_vars_t *vars = FLASH_VARS;
+  return (vars->app.verified == APP_VERIFIED_VAL) && (vars->app.confirmed == APP_CONFIRMED_VAL) &&
+         (vars->app.page_count > 0) && (vars->app.page_count <= BACKUP_PAGES) &&
+         ((vars->backup.page_count != vars->app.page_count) || (vars->backup.crc != vars->app.crc));
+}
+
+static void backup_start(void)
+{
+  // The slot holds nothing usable until the copy is done
+  struct bl_vars_t vars = *FLASH_VARS;
+  vars.backup.page_count = 0;
+  if (vars_write(&vars))
+  {
+    backup_job.failed = 1;
+    return;
+  }
+  backup_job.page = 0;
+  backup_job.erased = 0;
+  backup_job.ofs = 0;
+  backup_job.busy = 1;
+}
+
+// Do the next step of the backup, in steps as short as fls_job_step's
+static void backup_job_step(void)
+{
+  const uint32_t *app = APP_BASE + backup_job.page * PAGE_SIZE;
+  const uint32_t *page = BACKUP_BASE + backup_job.page * PAGE_SIZE;
+  uint8_t r = 0;
+
+  if (backup_job.page >= FLASH_VARS->app.page_count)
+  {
+    // Done, the slot now holds the app
+    struct bl_vars_t vars = *FLASH_VARS;
+    vars.backup.page_count = vars.app.page_count;
+    vars.backup.crc = vars.app.crc;
+    r = vars_write(&vars);
+    backup_job.busy = 0;
+  }
+  else if (!backup_job.erased)
+  {
+    if (0 == memcmp(page, app, 4 * PAGE_SIZE))
+    {
+      ++backup_job.page;
+      return;
+    }
+    page_crc_forget(BACKUP_FIRST_PAGE + backup_job.page);
+    HAL_FLASH_Unlock();
+    r = fls_erase(page);
+    HAL_FLASH_Lock();
+    backup_job.erased = 1;
+    backup_job.ofs = 0;
+  }
+  else if (backup_job.ofs < PAGE_SIZE)
+  {
+    HAL_FLASH_Unlock();
+    r = fls_prog(page + backup_job.ofs, app + backup_job.ofs, FLS_CHUNK);
+    HAL_FLASH_Lock();
+    backup_job.ofs += FLS_CHUNK;
+  }
+  else
+  {
+    if (0 != memcmp(page, app, 4 * PAGE_SIZE))
+      r = 10;
+    ++backup_job.page;
+    backup_job.erased = 0;
+  }
+
+  if (r)
+  {
+    // Update without a backup rather than not at all
+    backup_job.failed = 1;
+    backup_job.busy = 0;
   }
 }
 
-void can_irq(CAN_HandleTypeDef *pcan)
+// Do the next step of the page handed over by WRITE_PAGE: the erase, a chunk of words or the final check.
+// Short steps keep the main loop getting back to rx_ring.
+static void fls_job_step(void)
 {
-  CAN_RxHeaderTypeDef msg;
-  uint8_t data[8];
-  HAL_CAN_GetRxMessage(pcan, CAN_RX_FIFO0, &msg, data);
-  process_can_msg(&msg, data);
+  const uint32_t *page = APP_BASE + fls_job.page * PAGE_SIZE;
+  const uint32_t *buf = pagebuf[fls_job.buf];
+  uint8_t r = 0;
+
+  if (!fls_job.erased)
+  {
+    // does flash equal buffer already?
+    if (0 == memcmp(page, buf, 4 * PAGE_SIZE))
+    {
+      page_crc_set(fls_job.page, fls_job.crc);
+      fls_job.busy = 0;
+      return;
+    }
+    if (fls_job.page < BACKUP_FIRST_PAGE)
+    {
+      // The first change to an app that reported healthy. Back it up before it is gone, then come back for the page.
+      if (!backup_job.failed && backup_needed())
+      {
+        backup_start();
+        return;
+      }
+    }
+    else if (FLASH_VARS->backup.page_count != 0)
+    {
+      // A big app, or something staged in the backup slot (a bootloader update). It no longer holds the backup.
+      struct bl_vars_t vars = *FLASH_VARS;
+      vars.backup.page_count = 0;
+      r = vars_write(&vars);
+    }
+    page_crc_forget(fls_job.page);
+    HAL_FLASH_Unlock();
+    // The image is changing, so boots need the full CRC again until WRITE_CRC. Programming 0 needs no erase. Staging
+    // past the end of the app leaves it alone.
+    uint8_t app_page = (fls_job.page < BACKUP_FIRST_PAGE) || (fls_job.page < FLASH_VARS->app.page_count);
+    if (!r && app_page && (FLASH_VARS->app.verified != 0))
+    {
+      r = fls_prog((const uint32_t *)&FLASH_VARS->app.verified, &zero_word, 1);
+    }
+    if (!r)
+    {
+      r = fls_erase(page);
+    }
+    HAL_FLASH_Lock();
+    fls_job.erased = 1;
+  }
+  else if (fls_job.ofs < PAGE_SIZE)
+  {
+    HAL_FLASH_Unlock();
+    r = fls_prog(page + fls_job.ofs, buf + fls_job.ofs, FLS_CHUNK);
+    HAL_FLASH_Lock();
+    fls_job.ofs += FLS_CHUNK;
+  }
+  else
+  {
+    // verify
+    if (0 != memcmp(page, buf, 4 * PAGE_SIZE))
+    {
+      r = 10;
+    }
+    else
+    {
+      page_crc_set(fls_job.page, fls_job.crc); // Flash now holds exactly the buffer WRITE_PAGE checked
+    }
+    fls_job.busy = 0;
+  }
+
+  if (r)
+  {
+    fls_job.err_page = fls_job.page;
+    fls_job.busy = 0;
+  }
 }
 
 /* USER CODE END 0 */
@@ -343,6 +2188,17 @@ int main(void)
 
   /* USER CODE BEGIN Init */
   // configClocks();
+
+  // Move the vector table to RAM, so the CAN interrupt can be taken while flash is busy
+  for (uint32_t i = 0; i < VECTOR_COUNT; ++i)
+  {
+    ram_vectors[i] = g_pfnVectors[i];
+  }
+  ram_vectors[16 + USB_LP_CAN1_RX0_IRQn] = (uint32_t)can_irq;
+  ram_vectors[16 + CAN1_RX1_IRQn] = (uint32_t)can_irq;
+  ram_vectors[16 + USB_HP_CAN1_TX_IRQn] = (uint32_t)can_tx_irq;
+  SCB->VTOR = (uint32_t)ram_vectors;
+  __DSB();
   /* USER CODE END Init */
 
   /* Configure the system clock */
@@ -359,16 +2215,21 @@ int main(void)
   MX_IWDG_Init();
   /* USER CODE BEGIN 2 */
 
-  // Check build ID in flashs
-  if (BUILD_TIMESTAMP != FLASH_VARS->board.bl_build_version)
+  // Take over the vars of the previous bootloader, or start from defaults on a blank board
+  if (vars_migrate())
+  {
+    can_config_filters(); // The board ID may have changed
+  }
+
+  // Start a valid app without waiting, unless something asked for the bootloader
+  startup_to = boot_listen_time();
+  if (startup_to == 0)
   {
-    // Fresh BL build, reset FLASH_VARS
-    struct bl_vars_t new_bl_vars = {0};
-    new_bl_vars.board.bl_build_version = BUILD_TIMESTAMP;
-    if (fls_wr(APP_BASE - PAGE_SIZE, (uint32_t *)&new_bl_vars, sizeof(new_bl_vars) / 4))
+    if (app_check())
     {
-      Error_Handler();
+      app_start();
     }
+    startup_to = STARTUP_TO; // Nothing to start, wait for the flasher
   }
 
   /* USER CODE END 2 */
@@ -377,28 +2238,80 @@ int main(void)
   /* USER CODE BEGIN WHILE */
   while (1)
   {
+    rx_ring_process();
+
+    // Program the page handed over by WRITE_PAGE, while data for the next page keeps arriving in the other buffer.
+    // A backup the page has to wait for goes first.
+    if (backup_job.busy)
+    {
+      backup_job_step();
+    }
+    else if (fls_job.busy)
+    {
+      fls_job_step();
+    }
+
+    // Stream the range requested by READ_MEM, as far as the host has room for
+    if (read_job.busy)
+    {
+      read_job_step();
+    }
+
+    // Report the page CRCs requested by PAGE_CRC. Reading a page needs the CRC unit, and flash as it will be.
+    if (page_crc_job.busy && !fls_job.busy && !crc_job.busy)
+    {
+      page_crc_job_step();
+    }
+
+    // Finish APP_INFO once the DMA is through the app
+    if (crc_job.busy && !crc_dma_busy())
+    {
+      crc_job_finish();
+    }
+
+    // Switch bit rate once the BL_CMD_BITRATE reply has gone out. Don't wait forever if nobody acknowledges it.
+    if (bitrate.pending && (HAL_GetTick() - bitrate.since >= BITRATE_DELAY) &&
+        (((tx_ring.tail == tx_ring.head) && ((CAN1->TSR & CAN_TSR_TME) == CAN_TSR_TME)) ||
+         (HAL_GetTick() - bitrate.since > BITRATE_TO)))
+    {
+      bitrate.pending = 0;
+      can_set_bitrate(bitrate.rate);
+      bitrate.trial = (bitrate.rate != BL_BITRATE_500K);
+      bitrate.since = HAL_GetTick();
+    }
+
+    // Hand over to the boot stage for a bootloader update. The new bootloader waits for the flasher like after a boot
+    // request, so the host can check on it.
+    if (bl_update.pending && ((((tx_ring.tail == tx_ring.head) && ((CAN1->TSR & CAN_TSR_TME) == CAN_TSR_TME))) ||
+                              (HAL_GetTick() - bl_update.since > BITRATE_TO)))
+    {
+      boot_flags.request = BOOT_REQUEST_VAL;
+      bl_reset();
+    }
+
+    // Nothing arrived at the new bit rate, so the host couldn't follow. Go back to where it can reach us.
+    if (bitrate.trial && (HAL_GetTick() - bitrate.since > BITRATE_TO))
+    {
+      bitrate.trial = 0;
+      can_set_bitrate(BL_BITRATE_500K);
+    }
 
     // reset if no CAN messages received
     uint32_t timeout;
     if (message_received)
       timeout = NOCANRX_TO;
     else
-      timeout = STARTUP_TO;
+      timeout = startup_to;
 
     if (HAL_GetTick() - lastcanrx > timeout)
     {
-
-      if ((FLASH_VARS->app.page_count > 0) && (FLASH_VARS->app.page_count <= PAGE_COUNT))
+      // Check the app before jumping to it
+      if (app_check())
       {
-        // Check app CRC before jumping to the app
-        uint32_t crc = HAL_CRC_Calculate(&hcrc, (uint32_t *)APP_BASE, FLASH_VARS->app.page_count * PAGE_SIZE);
-        if (crc == FLASH_VARS->app.crc)
-        {
-          *(MAGIC_ADDR) = MAGIC_VAL;
-        }
+        app_start();
       }
-      // Reset the processor. If the magic value was set, the bootloader will be skipped, otherwise, the bootloader will restart.
-      __NVIC_SystemReset();
+      // No valid app. Reset the processor to listen again.
+      bl_reset();
     }
 
     // // feed watchdog
@@ -476,38 +2389,22 @@ static void MX_CAN_Init(void)
   hcan.Init.AutoWakeUp = DISABLE;
   hcan.Init.AutoRetransmission = ENABLE;
   hcan.Init.ReceiveFifoLocked = DISABLE;
-  hcan.Init.TransmitFifoPriority = DISABLE;
+  hcan.Init.TransmitFifoPriority = ENABLE;
   if (HAL_CAN_Init(&hcan) != HAL_OK)
   {
     Error_Handler();
   }
   /* USER CODE BEGIN CAN_Init 2 */
-  // Accept all CAN messages
-  CAN_FilterTypeDef sf;
-  sf.FilterMaskIdHigh = 0x0000;
-  sf.FilterMaskIdLow = 0x0000;
-  sf.FilterFIFOAssignment = CAN_FILTER_FIFO0;
-  sf.FilterBank = 0;
-  sf.FilterMode = CAN_FILTERMODE_IDMASK;
-  sf.FilterScale = CAN_FILTERSCALE_32BIT;
-  sf.FilterActivation = CAN_FILTER_ENABLE;
-
-  if (HAL_CAN_ConfigFilter(&hcan, &sf) != HAL_OK)
-  {
-    Error_Handler();
-  }
-
-  if (HAL_CAN_RegisterCallback(&hcan, HAL_CAN_RX_FIFO0_MSG_PENDING_CB_ID, can_irq))
-  {
-    Error_Handler();
-  }
+  // Only accept bootloader frames
+  can_config_filters();
 
   if (HAL_CAN_Start(&hcan) != HAL_OK)
   {
     Error_Handler();
   }
 
-  if (HAL_CAN_ActivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING) != HAL_OK)
+  if (HAL_CAN_ActivateNotification(&hcan, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO1_MSG_PENDING |
+                                               CAN_IT_TX_MAILBOX_EMPTY) != HAL_OK)
   {
     Error_Handler();
   }
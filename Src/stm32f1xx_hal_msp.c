@@ -115,8 +115,12 @@ void HAL_CAN_MspInit(CAN_HandleTypeDef* hcan)
     __HAL_AFIO_REMAP_CAN1_2();
 
     /* CAN1 interrupt Init */
+    HAL_NVIC_SetPriority(USB_HP_CAN1_TX_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(USB_HP_CAN1_TX_IRQn);
     HAL_NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+    HAL_NVIC_SetPriority(CAN1_RX1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(CAN1_RX1_IRQn);
   /* USER CODE BEGIN CAN1_MspInit 1 */
 
   /* USER CODE END CAN1_MspInit 1 */
@@ -147,7 +151,9 @@ void HAL_CAN_MspDeInit(CAN_HandleTypeDef* hcan)
     HAL_GPIO_DeInit(GPIOB, GPIO_PIN_8|GPIO_PIN_9);
 
     /* CAN1 interrupt DeInit */
+    HAL_NVIC_DisableIRQ(USB_HP_CAN1_TX_IRQn);
     HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    HAL_NVIC_DisableIRQ(CAN1_RX1_IRQn);
   /* USER CODE BEGIN CAN1_MspDeInit 1 */
 
   /* USER CODE END CAN1_MspDeInit 1 */
@@ -171,6 +177,8 @@ void HAL_CRC_MspInit(CRC_HandleTypeDef* hcrc)
     /* Peripheral clock enable */
     __HAL_RCC_CRC_CLK_ENABLE();
   /* USER CODE BEGIN CRC_MspInit 1 */
+    // DMA1 channel 1 feeds the CRC unit, see crc_dma_start
+    __HAL_RCC_DMA1_CLK_ENABLE();
 
   /* USER CODE END CRC_MspInit 1 */
   }
@@ -193,6 +201,8 @@ void HAL_CRC_MspDeInit(CRC_HandleTypeDef* hcrc)
     /* Peripheral clock disable */
     __HAL_RCC_CRC_CLK_DISABLE();
   /* USER CODE BEGIN CRC_MspDeInit 1 */
+    DMA1_Channel1->CCR = 0;
+    __HAL_RCC_DMA1_CLK_DISABLE();
 
   /* USER CODE END CRC_MspDeInit 1 */
   }
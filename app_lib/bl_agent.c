@@ -0,0 +1,248 @@
+// Download agent, see bl_agent.h
+
+#include "stm32f1xx_hal.h"
+#include "bl_agent.h"
+#include <string.h>
+
+// Commands and error codes of the bootloader (Inc/main.h) the agent handles
+#define CMD_WRITE_BUF 1
+#define CMD_WRITE_PAGE 2
+#define CMD_WRITE_CRC 3
+#define CMD_PING 4
+#define CMD_STREAM_BUF 6
+#define CMD_BUF_STATUS 7
+
+#define ERR_INVALID_PAGE_NUM 1
+#define ERR_INVALID_CRC 2
+#define ERR_FLASH_WRITE 3
+#define ERR_INVALID_OFFSET 5
+#define ERR_BUSY 7
+
+#define CAP_STREAM (1UL << 0)
+#define CAP_SACK (1UL << 1)
+
+#define STAGE_REQ ((volatile uint32_t *)BL_STAGE_REQ_ADDR) // open, page_count, crc, ready
+
+// Symbols of the CubeMX linker script. The initial values of .data are the last thing in the app's flash image.
+extern uint32_t _sidata, _sdata, _edata;
+
+static uint8_t agent_id;
+static bl_agent_tx_t agent_tx;
+
+static uint32_t pagebuf[BL_PAGE_WORDS];
+static uint32_t rxmask[BL_PAGE_WORDS / 32];
+
+// Command handed over to bl_agent_poll. Frames for the page buffer are turned away until it is done.
+static volatile struct
+{
+  uint8_t cmd; // 0 = none
+  uint16_t par1;
+  uint32_t par2;
+} job;
+
+static void agent_reply(uint8_t cmd, uint8_t ec, const uint8_t *payload, uint8_t len)
+{
+  uint8_t data[8];
+  data[0] = agent_id;
+  data[1] = cmd;
+  data[2] = ec;
+  if (len)
+    memcpy(&data[3], payload, len);
+  agent_tx(BL_AGENT_CANID_RPLY + agent_id, data, 3 + len);
+}
+
+// CRC-32/MPEG-2 one word at a time, same as the bootloader's CRC unit. A nibble at a time.
+static uint32_t agent_crc(uint32_t crc, const uint32_t *data, uint32_t len)
+{
+  static const uint32_t table[16] = {
+      0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+      0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
+  };
+  for (uint32_t i = 0; i < len; ++i)
+  {
+    crc ^= data[i];
+    for (uint32_t n = 0; n < 8; ++n)
+    {
+      crc = (crc << 4) ^ table[crc >> 28];
+    }
+  }
+  return crc;
+}
+
+// Program a word of the stage request. They are left erased by the bootloader, so no erase is needed.
+static uint8_t agent_stage_word(uint32_t index, uint32_t val)
+{
+  HAL_FLASH_Unlock();
+  HAL_StatusTypeDef s = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t)&STAGE_REQ[index], val);
+  HAL_FLASH_Lock();
+  return (s != HAL_OK) || (STAGE_REQ[index] != val);
+}
+
+// Whether the running app leaves the backup slot alone
+static uint8_t agent_app_fits(void)
+{
+  uint32_t end = (uint32_t)&_sidata + ((uint32_t)&_edata - (uint32_t)&_sdata);
+  return end <= BL_STAGE_BASE;
+}
+
+// Write a page of the backup slot unless it holds the buffer already
+static uint8_t agent_write_page(uint32_t page)
+{
+  uint32_t addr = BL_STAGE_BASE + page * 4 * BL_PAGE_WORDS;
+  if (memcmp((const void *)addr, pagebuf, sizeof(pagebuf)) == 0)
+    return 0;
+
+  // Tell the bootloader the backup no longer holds what it thinks
+  if ((STAGE_REQ[0] != BL_STAGE_OPEN_VAL) && agent_stage_word(0, BL_STAGE_OPEN_VAL))
+    return 1;
+
+  FLASH_EraseInitTypeDef erase = {.TypeErase = FLASH_TYPEERASE_PAGES, .PageAddress = addr, .NbPages = 1};
+  uint32_t error_page;
+  HAL_FLASH_Unlock();
+  HAL_StatusTypeDef s = HAL_FLASHEx_Erase(&erase, &error_page);
+  for (uint32_t i = 0; (i < BL_PAGE_WORDS) && (s == HAL_OK); ++i)
+  {
+    s = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr + 4 * i, pagebuf[i]);
+  }
+  HAL_FLASH_Lock();
+  return (s != HAL_OK) || (memcmp((const void *)addr, pagebuf, sizeof(pagebuf)) != 0);
+}
+
+// Check the whole staged image and leave the stage request for the bootloader
+static uint8_t agent_stage(uint32_t page_count, uint32_t crc)
+{
+  if ((page_count == 0) || (page_count > BL_STAGE_PAGES))
+    return ERR_INVALID_PAGE_NUM;
+  if (agent_crc(0xFFFFFFFF, (const uint32_t *)BL_STAGE_BASE, page_count * BL_PAGE_WORDS) != crc)
+    return ERR_INVALID_CRC;
+  if ((STAGE_REQ[0] != BL_STAGE_OPEN_VAL) && agent_stage_word(0, BL_STAGE_OPEN_VAL))
+    return ERR_FLASH_WRITE;
+  if (agent_stage_word(1, page_count) || agent_stage_word(2, crc) || agent_stage_word(3, BL_STAGE_READY_VAL))
+    return ERR_FLASH_WRITE;
+  return 0;
+}
+
+void bl_agent_init(uint8_t board_id, bl_agent_tx_t tx)
+{
+  agent_id = board_id;
+  agent_tx = tx;
+}
+
+uint8_t bl_agent_staged(void)
+{
+  return STAGE_REQ[3] == BL_STAGE_READY_VAL;
+}
+
+uint8_t bl_agent_rx(uint32_t std_id, const uint8_t *data, uint8_t len)
+{
+  if ((std_id != BL_AGENT_CANID_CMD) || (len != 8))
+    return 0;
+  uint8_t cmd = data[1];
+  uint16_t par1 = data[2] | (data[3] << 8);
+  uint32_t par2;
+  memcpy(&par2, &data[4], sizeof(par2));
+
+  if (cmd == CMD_PING)
+  {
+    // All boards reply to ping
+    uint32_t caps = CAP_STREAM | CAP_SACK | BL_CAP_AGENT;
+    agent_reply(cmd, 0, (uint8_t *)&caps, sizeof(caps));
+    return 1;
+  }
+  if (data[0] != agent_id)
+    return 0;
+  if (job.cmd)
+  {
+    agent_reply(cmd, ERR_BUSY, 0, 0);
+    return 1;
+  }
+
+  switch (cmd)
+  {
+  case CMD_WRITE_BUF:
+  case CMD_STREAM_BUF:
+    if (par1 >= BL_PAGE_WORDS)
+    {
+      agent_reply(cmd, ERR_INVALID_OFFSET, 0, 0);
+      break;
+    }
+    pagebuf[par1] = par2;
+    rxmask[par1 / 32] |= 1UL << (par1 % 32);
+    if (cmd == CMD_WRITE_BUF)
+      agent_reply(cmd, 0, 0, 0);
+    break;
+
+  case CMD_BUF_STATUS:
+    if (par1 >= BL_PAGE_WORDS)
+    {
+      agent_reply(cmd, ERR_INVALID_OFFSET, 0, 0);
+    }
+    else
+    {
+      // The offset asked about and a bitmap of the missing words from it on
+      uint8_t status[5];
+      status[0] = par1;
+      uint32_t bitmap = 0;
+      for (uint32_t i = 0; i < 32; ++i)
+      {
+        uint32_t w = par1 + i;
+        if ((w < BL_PAGE_WORDS) && !(rxmask[w / 32] & (1UL << (w % 32))))
+          bitmap |= 1UL << i;
+      }
+      memcpy(&status[1], &bitmap, sizeof(bitmap));
+      agent_reply(cmd, 0, status, sizeof(status));
+    }
+    break;
+
+  case CMD_WRITE_PAGE:
+  case CMD_WRITE_CRC:
+    if (!agent_app_fits())
+    {
+      agent_reply(cmd, ERR_INVALID_PAGE_NUM, 0, 0); // Staging would overwrite the app itself
+      break;
+    }
+    if (bl_agent_staged())
+    {
+      agent_reply(cmd, ERR_FLASH_WRITE, 0, 0); // Nothing more until the staged image is installed
+      break;
+    }
+    job.par1 = par1;
+    job.par2 = par2;
+    job.cmd = cmd;
+    break;
+
+  default:
+    return 0; // Not for the agent
+  }
+  return 1;
+}
+
+void bl_agent_poll(void)
+{
+  uint8_t cmd = job.cmd;
+  uint8_t ec = 0;
+  if (cmd == CMD_WRITE_PAGE)
+  {
+    if (job.par1 >= BL_STAGE_PAGES)
+      ec = ERR_INVALID_PAGE_NUM;
+    else if (agent_crc(0xFFFFFFFF, pagebuf, BL_PAGE_WORDS) != job.par2)
+      ec = ERR_INVALID_CRC;
+    else if (agent_write_page(job.par1))
+      ec = ERR_FLASH_WRITE;
+    else
+    {
+      // Next page
+      memset(rxmask, 0, sizeof(rxmask));
+    }
+  }
+  else if (cmd == CMD_WRITE_CRC)
+  {
+    ec = agent_stage(job.par1, job.par2);
+  }
+  else
+  {
+    return;
+  }
+  job.cmd = 0;
+  agent_reply(cmd, ec, 0, 0);
+}
@@ -0,0 +1,55 @@
+#ifndef BL_AGENT_H
+#define BL_AGENT_H
+
+// Download agent for applications running under the CAN bootloader. Values have to match Inc/main.h of the bootloader.
+//
+// The agent speaks the bootloader's page protocol (Ping, Write page buffer, Stream page buffer, Buffer status, Write page
+// and Write CRC) while the app keeps running, and writes the pages into the backup slot instead of the app. Once Write CRC
+// has checked the whole image there, it leaves a stage request in the bootloader's settings page. The next reset, at a
+// time the app picks, swaps the slots: the staged image becomes the app and the running app its backup. The board is
+// only offline for that reset and the swap (about 80 ms per page).
+//
+// `can_flash.py flash` finds the agent through the BL_CAP_AGENT capability and stages the image the same way it would
+// flash it. To use it:
+// 1. Add bl_agent.c to the build, and let standard ID 0x700 through the CAN filters
+// 2. Call bl_agent_init with the board's bootloader ID and a function sending a standard ID frame
+// 3. Pass every standard ID frame received to bl_agent_rx, e.g. from HAL_CAN_RxFifo0MsgPendingCallback
+// 4. Call bl_agent_poll from the main loop. It erases and programs flash, which stalls the CPU for up to 20 ms a page
+//    while it runs. Interrupt handlers in flash wait as well.
+// 5. Once bl_agent_staged returns 1, reset (__NVIC_SystemReset) whenever it suits the app
+//
+// The backup slot holds the last healthy app for rollback (see bl_app_healthy), so staging gives that up until the
+// swap makes the running app the backup.
+//
+// The backup slot is the upper half of the app region, so only apps of up to 26 pages (26K) can stage an image, and
+// only images of up to 25 pages. The agent refuses Write page and Write CRC with the invalid page error if the running
+// app reaches into the backup slot (found from the _sidata, _sdata and _edata symbols of the CubeMX linker script).
+
+#include <stdint.h>
+
+#define BL_AGENT_CANID_CMD 0x700
+#define BL_AGENT_CANID_RPLY 0x701 // Plus the board ID
+
+#define BL_CAP_AGENT (1UL << 15)
+
+#define BL_PAGE_WORDS 256
+#define BL_STAGE_BASE 0x08009800UL // Backup slot, after the 26 pages of the app slot
+#define BL_STAGE_PAGES 25
+
+// struct stage_req_t in the bootloader, 64 words below the end of the settings page
+#define BL_STAGE_REQ_ADDR 0x08002EF0UL
+#define BL_STAGE_OPEN_VAL ((uint32_t)0x57a6e0be)
+#define BL_STAGE_READY_VAL ((uint32_t)0x57a6e4d1)
+
+// Sends a standard ID frame. Called from bl_agent_rx and bl_agent_poll.
+typedef void (*bl_agent_tx_t)(uint32_t std_id, const uint8_t *data, uint8_t len);
+
+void bl_agent_init(uint8_t board_id, bl_agent_tx_t tx);
+// Returns 1 if the frame was for the agent
+uint8_t bl_agent_rx(uint32_t std_id, const uint8_t *data, uint8_t len);
+// Programs a page handed over by Write page, or checks the image for Write CRC, and replies
+void bl_agent_poll(void);
+// 1 once an image is staged and waits for a reset to be installed. The agent takes no more pages until then.
+uint8_t bl_agent_staged(void);
+
+#endif // BL_AGENT_H
@@ -0,0 +1,112 @@
+#ifndef BL_APP_H
+#define BL_APP_H
+
+// Helpers for applications running under the CAN bootloader. Include from the app after the STM32 HAL/CMSIS headers.
+// Values have to match Inc/main.h of the bootloader.
+
+#include <stdint.h>
+
+// The bootloader keeps its boot flags and the crash record at the start of RAM (see .noinit in the bootloader's linker
+// script). Leave that much RAM out of the app's linker script, so the record survives while the app runs:
+//   RAM (xrw) : ORIGIN = 0x20000100, LENGTH = 20K - 0x100
+// The bootloader checks a version word there at every boot. Apps that still use all of RAM overwrite it, and the
+// bootloader then ignores the boot request, crash record and healthy report rather than misread them.
+#define BL_SHARED_RAM 0x100
+#define BL_RAM_END 0x20005000UL
+
+#define BL_BOOT_REQUEST_ADDR ((volatile uint32_t *)0x20000000)
+#define BL_BOOT_REQUEST_VAL ((uint32_t)0x5b0071e2)
+
+// Same layout as struct crash_record_t in the bootloader
+#define BL_CRASH_STACK_WORDS 32
+struct bl_crash_t
+{
+  uint32_t magic;
+  uint32_t reset_csr; // Filled in by the bootloader
+  uint32_t exc_return;
+  uint32_t sp;
+  uint32_t cfsr;
+  uint32_t hfsr;
+  uint32_t mmfar;
+  uint32_t bfar;
+  uint32_t frame[8]; // r0-r3, r12, lr, pc, xpsr
+  uint32_t stack[BL_CRASH_STACK_WORDS];
+};
+#define BL_CRASH_ADDR ((volatile struct bl_crash_t *)0x20000008)
+#define BL_CRASH_MAGIC ((uint32_t)0xc4a5b10c)
+
+// healthy word of struct boot_health_t in the bootloader, right after the crash record
+#define BL_APP_HEALTHY_ADDR ((volatile uint32_t *)0x200000D0)
+#define BL_APP_HEALTHY_VAL ((uint32_t)0x600dc0de)
+
+// Reset into the bootloader and have it wait for the flasher (2 s) instead of starting the app again.
+// A plain reset works too, but only gets a 200 ms window.
+static inline void bl_enter_bootloader(void)
+{
+  *BL_BOOT_REQUEST_ADDR = BL_BOOT_REQUEST_VAL;
+  __DSB();
+  __NVIC_SystemReset();
+}
+
+// Tell the bootloader this image works. Call once the app is fully up (peripherals initialized, talking on the bus).
+// A new image that resets BL_BOOT_ATTEMPTS (3) times in a row with a crash record or by the watchdog before calling
+// this is replaced by the last image that did. Takes effect with the next reset, so it costs nothing to call often.
+static inline void bl_app_healthy(void)
+{
+  *BL_APP_HEALTHY_ADDR = BL_APP_HEALTHY_VAL;
+}
+
+static inline uint8_t bl_in_ram(uint32_t addr, uint32_t len)
+{
+  return (addr >= 0x20000000UL) && (addr + len <= BL_RAM_END);
+}
+
+// Fill in the crash record from the frame the fault stacked, then reset. The bootloader adds the reset reason and
+// keeps the record until `can_flash.py crash` clears it or power is lost. Entered from BL_HARDFAULT_HANDLER.
+__attribute__((used, noreturn)) static void bl_crash_save(const uint32_t *frame, uint32_t exc_return)
+{
+  volatile struct bl_crash_t *c = BL_CRASH_ADDR;
+  c->magic = 0; // Not valid until complete
+  c->reset_csr = 0;
+  c->exc_return = exc_return;
+  c->cfsr = SCB->CFSR;
+  c->hfsr = SCB->HFSR;
+  c->mmfar = SCB->MMFAR;
+  c->bfar = SCB->BFAR;
+
+  // After a stack overflow the stack pointer may point outside RAM. Reading it would fault again and lock up.
+  uint32_t sp = (uint32_t)frame;
+  if (bl_in_ram(sp, sizeof(c->frame)))
+  {
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+      c->frame[i] = frame[i];
+    }
+    sp += sizeof(c->frame) + ((frame[7] & (1UL << 9)) ? 4 : 0); // xPSR bit 9: the frame was aligned to 8 bytes
+  }
+  c->sp = sp;
+  for (uint32_t i = 0; i < BL_CRASH_STACK_WORDS; ++i)
+  {
+    uint32_t addr = sp + 4 * i;
+    c->stack[i] = bl_in_ram(addr, 4) ? *(const uint32_t *)addr : 0;
+  }
+
+  c->magic = BL_CRASH_MAGIC;
+  __DSB();
+  __NVIC_SystemReset();
+}
+
+// Defines HardFault_Handler to leave a crash record for the bootloader and reset. Use it once at file scope in place of
+// the handler CubeMX generates in stm32f1xx_it.c. Naked, so the stack is exactly as the fault left it.
+#define BL_HARDFAULT_HANDLER()                                                                                         \
+  __attribute__((naked)) void HardFault_Handler(void)                                                                 \
+  {                                                                                                                    \
+    __asm volatile("tst lr, #4\n"                                                                                      \
+                   "ite eq\n"                                                                                          \
+                   "mrseq r0, msp\n"                                                                                   \
+                   "mrsne r0, psp\n"                                                                                   \
+                   "mov r1, lr\n"                                                                                      \
+                   "b bl_crash_save\n");                                                                               \
+  }
+
+#endif // BL_APP_H
@@ -0,0 +1,32 @@
+#ifndef BL_STUB_H
+#define BL_STUB_H
+
+// For RAM stubs run by the CAN bootloader (BL_CMD_RUN_STUB). Values have to match Inc/main.h of the bootloader.
+//
+// A stub is a raw binary of at most 1 KB, loaded at the address the load reply reports (`run_stub` prints it). Code
+// without static data can be built position independent, anything else has to be linked for that address:
+//   arm-none-eabi-gcc -mcpu=cortex-m3 -mthumb -Os -nostdlib -ffreestanding -Wl,-Ttext=<address> -o stub.elf stub.c
+//   arm-none-eabi-objcopy -O binary stub.elf stub.bin
+// Keep the entry point at the start of the binary, or pass its offset to run_stub. Run it with
+// `can_flash.py run_stub -b <board> stub.bin`. The return code and result come back to the host.
+// Stubs running longer than 400 ms have to reload the watchdog (IWDG->KR = 0xAAAA).
+
+#include <stdint.h>
+
+#define BL_STUB_ABI_VERSION 1
+
+struct bl_stub_args_t
+{
+  uint32_t abi_version; // BL_STUB_ABI_VERSION
+  uint32_t arg;         // Argument given to run_stub
+  uint32_t *buf;        // Bootloader page buffer, holding whatever the host sent after loading the stub
+  uint32_t buf_words;
+  uint32_t result;      // Sent back to the host next to the return code
+  // Flash routines of the bootloader, running from RAM. Flash has to be unlocked. Return 0 on success.
+  uint8_t (*erase)(const uint32_t *page);
+  uint8_t (*prog)(const uint32_t *page, const uint32_t *buf, uint32_t len);
+};
+
+typedef uint8_t (*bl_stub_entry_t)(struct bl_stub_args_t *args);
+
+#endif // BL_STUB_H
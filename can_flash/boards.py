@@ -7,6 +7,7 @@ class Board:
     board_id: int
     name: str
     fw_path: Path
+    group: int = 0  # Boards sharing a non-zero group (and firmware) are flashed together
 
 
 # Firmwares for each bootloader ID
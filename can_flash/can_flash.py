@@ -2,6 +2,7 @@ import crcmod as crcmod
 import argparse
 import subprocess
 import os
+import lz4_block
 from colors import *
 from boards import board_firmwares
 
@@ -10,6 +11,9 @@ from can_util import *
 from sys import platform
 
 PAGE_RETRIES = 10
+WINDOW_RETRIES = 10
+DEFAULT_WINDOW = 64  # Words sent before asking the board which ones it is missing
+LZ4_MIN_SAVING = 64  # Bytes compression has to save to be worth the extra command
 
 
 def list_connected_boards(channel=None):
@@ -33,60 +37,146 @@ def list_connected_boards(channel=None):
                   'Be sure to set a proper ID before flashing these boards.')
 
 
+# Split data into {word offset: byte-reversed word}, the format bl_cmd expects
+def to_words(data):
+    return {w: data[w * 4:w * 4 + 4][::-1] for w in range(len(data) // 4)}
+
+
+# Stream words of the page buffer without waiting for replies. With group=True, board_id is a group ID.
+# Other buffers (frame_type) can only be sent in dense frames.
+def send_words(bus, board_id, page_data, words, caps, group=False, frame_type=BL_DATA_PAGE):
+    if caps & BL_CAP_DENSE:
+        # Two words per frame. page_data holds byte-reversed words for bl_cmd, so undo that here.
+        if group:
+            frame_type |= BL_DATA_GROUP
+        for w in sorted({w & ~1 for w in words}):
+            bl_data(bus, board_id, frame_type, w, page_data[w][::-1] + page_data[w + 1][::-1])
+    else:
+        can_id = CANID_BL_GRP_CMD if group else CANID_BL_CMD
+        for w in words:
+            bl_cmd(bus, board_id, BL_STREAM_BUF, w, page_data[w], can_id=can_id)
+
+
+# Stream a page window by window, resending only the words the board reports missing.
+# If members is given, board_id is a group ID and words missing on any member are resent to the group.
+def send_page_windowed(bus, board_id, page_data, caps, window, members=None, frame_type=BL_DATA_PAGE):
+    num_words = len(page_data)
+    for start in range(0, num_words, window):
+        print('.', end='')
+        pending = list(range(start, min(start + window, num_words)))
+        for i in range(WINDOW_RETRIES):
+            send_words(bus, board_id, page_data, pending, caps, group=members is not None, frame_type=frame_type)
+            # Bitmaps cover 32 words, so drop anything past the end of this window
+            end = min(start + window, num_words)
+            pending = []
+            for first in range(start, end, 32):
+                if members is None:
+                    missing = bl_missing_words(bus, board_id, first)
+                else:
+                    missing = bl_group_missing_words(bus, board_id, members, first)
+                pending += [w for w in missing if w < end]
+            if len(pending) == 0:
+                break
+        else:
+            raise RuntimeError(f'Words still missing after {WINDOW_RETRIES} retries')
+
+
+# Fill the page buffer of a board (or every member of a group), compressing the page if that saves enough frames.
+# patch is an (LZ4 block, dictionary length) pair from plan_delta to send instead.
+def send_page(bus, board_id, page_data, caps, window, members=None, patch=None):
+    if patch is None and caps & BL_CAP_LZ4:
+        z = lz4_block.compress(b''.join(d[::-1] for d in page_data.values()))
+        if len(z) + LZ4_MIN_SAVING <= PG_SIZE:
+            patch = (z, 0)
+
+    if patch is not None:
+        z, dict_len = bytearray(patch[0]), patch[1]
+        z_len = len(z)
+        z.extend(bytearray(-z_len % 8))  # Whole dense frames
+        send_page_windowed(bus, board_id, to_words(z), caps, window, members, frame_type=BL_DATA_ZBUF)
+        if members is None:
+            bl_cmd_response(bus, board_id, BL_DECOMPRESS, z_len, dict_len.to_bytes(4, 'big'))
+        else:
+            # A member that fails to decompress fails the page CRC check and gets patched up later
+            bl_cmd(bus, board_id, BL_DECOMPRESS, z_len, dict_len.to_bytes(4, 'big'), can_id=CANID_BL_GRP_CMD)
+            bl_waitresp_all(bus, members, BL_DECOMPRESS, 0.05)
+        return
+
+    send_page_windowed(bus, board_id, page_data, caps, window, members)
+
+
 # (try to) Flash a single page to the mcu
-def flash_page(bus, board_id, page, pcrc, page_data):
+def flash_page(bus, board_id, page, pcrc, page_data, caps=0, window=DEFAULT_WINDOW, patch=None):
+    if caps & BL_CAP_SACK:
+        send_page(bus, board_id, page_data, caps, window, patch=patch)
+        bl_cmd_response(bus, board_id, BL_WPAGE, page, pcrc.digest())
+        return
+
     for w, d in page_data.items():
         if w % 16 == 0:
             print('.', end='')
-        # Send data and get response
-        bl_cmd_response(bus, board_id, BL_WBUF, w, d)
+        if caps & BL_CAP_STREAM:
+            # Stream the page without waiting. The page CRC catches lost frames.
+            bl_cmd(bus, board_id, BL_STREAM_BUF, w, d)
+        else:
+            # Send data and get response
+            bl_cmd_response(bus, board_id, BL_WBUF, w, d)
 
     bl_cmd_response(bus, board_id, BL_WPAGE, page, pcrc.digest())
 
 
-# Flash an entire file to the mcu
-def flash(board_id, filepath, channel=None, interactive=True):
-    if interactive and not filepath.endswith('.bin'):
-        response = input('File path does not end in ".bin". Flash anyway? (Y/n): ')
-        if 'n' in response.lower():
-            print('Firmware flashing canceled')
-            exit(0)
-
-    bus = get_can_bus(channel)
-
+# Retry a page until it is flashed or PAGE_RETRIES runs out. Returns whether the page was flashed.
+# A delta patch is only tried once. A failed write may have clobbered the old page it copies from.
+def retry_page(bus, board_id, page, num_pages, pcrc, page_data, caps, window, patch=None):
+    for i in range(PAGE_RETRIES):
+        try:
+            flash_page(bus, board_id, page, pcrc, page_data, caps, window, patch if i == 0 else None)
+            return True
+        except RuntimeError as e:
+            print('Error flashing page: ', e)
+            print(f'Retrying Page {page}/{num_pages - 1}', end='')
+    return False
+
+
+# Pages are programmed after the board replies to WRITE_PAGE, so a page that failed to program is only reported while
+# sending a later one. Find and resend such pages. Returns whether every page is OK now.
+def fix_bad_pages(bus, board_id, pages, caps, window):
+    if not caps & BL_CAP_PAGE_CRC:
+        return True  # WRITE_CRC still catches them
+    for p in bl_changed_pages(bus, board_id, pages):
+        pcrc, page_data = pages[p]
+        print(f'Page {p}/{len(pages) - 1} again', end='')
+        if not retry_page(bus, board_id, p, len(pages), pcrc, page_data, caps, window):
+            return False
+        print(" CRC OK")
+    return True
+
+
+# Read an image and extend it to the next whole page
+def load_image(filepath):
     f = open(filepath, "rb")
     b = bytearray(f.read())
     f.close()
 
-    # Extend to the next whole page
-    b.extend(bytearray(PG_SIZE - (len(b) % PG_SIZE)))
-    num_pages = len(b) // PG_SIZE
+    # Pad the last page, an image of whole pages stays as it is
+    if len(b) % PG_SIZE:
+        b.extend(bytearray(PG_SIZE - (len(b) % PG_SIZE)))
+    return b
 
+
+# Split an image into (page CRC, {word offset: data}) for each page. Also returns the CRC of the entire image.
+def split_pages(b):
     # App CRC
     acrc = crcmod.Crc(0x104c11db7, initCrc=0xffffffff, rev=False)
 
-    # Reset & connect to board
-    print(f'Attempting to connect to board with ID {board_id}')
-    if not bl_wait_for_connection(bus, board_id):
-        if interactive:
-            print('Could not connect to board.')
-            exit(1)
-        else:
-            raise RuntimeError('Could not connect to board.')
-
-    print(f'Connected to board {board_id}. Uploading {filepath}')
-
-    # TODO Ability to retry pages that failed
-    for p in range(num_pages):
-        print(f'Page {p}/{num_pages - 1}', end='')
+    pages = []
+    for p in range(len(b) // PG_SIZE):
         # Start calculating page CRC
         pcrc = crcmod.Crc(0x104c11db7, initCrc=0xffffffff, rev=False)
 
         # Iterate over each 32-bit word of the page
-        # First generate CRCs and data
         page_data = {}
         for w in range(PG_SIZE // 4):
-            # Get next data to send
             a = (p * PG_SIZE) + (w * 4)
             d = b[a:a + 4][::-1]  # take out 4 bytes and reverse them
 
@@ -95,24 +185,154 @@ def flash(board_id, filepath, channel=None, interactive=True):
             pcrc.update(d)
 
             page_data[w] = d
+        pages.append((pcrc, page_data))
+
+    return pages, acrc
+
+
+# Plan a delta update from old, the image installed on the board, to b. Each page is LZ4 compressed with the start of
+# the app region in flash as its dictionary, so it can copy anything from the old image that is still there when the
+# page is written. Both page orders are tried: ascending suits code that moved down, descending code that moved up.
+# Returns the page order and {page: (LZ4 block, dictionary length)} for the pages worth sending as a delta.
+def plan_delta(old, b, changed):
+    best = None
+    for order in (sorted(changed), sorted(changed, reverse=True)):
+        # Contents of each page in flash while the update runs. None = unknown, stale data past the end of old.
+        flash_pages = [old[p * PG_SIZE:(p + 1) * PG_SIZE] for p in range(len(old) // PG_SIZE)]
+        flash_pages += [None] * (len(b) // PG_SIZE - len(flash_pages))
+        for p in range(len(b) // PG_SIZE):
+            if p not in changed:
+                flash_pages[p] = b[p * PG_SIZE:(p + 1) * PG_SIZE]
+
+        patches = {}
+        size = 0
+        for p in order:
+            known = flash_pages[:flash_pages.index(None)] if None in flash_pages else flash_pages
+            dictionary = b''.join(known)
+            page = b[p * PG_SIZE:(p + 1) * PG_SIZE]
+            # The same page of the old image is the most likely match
+            z = lz4_block.compress(page, dictionary, len(dictionary) - p * PG_SIZE if p < len(known) else 0)
+            if len(z) + LZ4_MIN_SAVING <= PG_SIZE:
+                patches[p] = (z, len(dictionary))
+                size += len(z)
+            else:
+                size += PG_SIZE
+            flash_pages[p] = page
+
+        if best is None or size < best[0]:
+            best = (size, order, patches)
+    return best[1], best[2]
+
+
+# Try to move the boards to a faster bit rate for the rest of the flashing session.
+# Returns the bus to use and whether the switch worked.
+def start_fast_session(bus, channel, board_ids, caps, bitrate, group=0):
+    if not is_slcan_channel(channel):
+        print(yellow('Bit rate switching needs an slcan adapter. Staying at the default bit rate.'))
+        return bus, False
+    if not caps & BL_CAP_BITRATE:
+        print(yellow('Bootloader does not support bit rate switching. Staying at the default bit rate.'))
+        return bus, False
+    bus, ok = bl_switch_bitrate(bus, channel, board_ids, bitrate, group)
+    if ok:
+        print(f'Switched to {bitrate} bit/s')
+    else:
+        print(yellow('Bit rate switch failed. Staying at the default bit rate.'))
+    return bus, ok
 
-        page_success = False
-        for i in range(PAGE_RETRIES):
-            try:
-                flash_page(bus, board_id, p, pcrc, page_data)
-                print(" CRC OK")
-                page_success = True
-                break
-            except RuntimeError as e:
-                print('Error flashing page: ', e)
-                print(f'Retrying Page {p}/{num_pages - 1}', end='')
-        if not page_success:
+
+# Put the boards back at the default bit rate, so they don't disturb the rest of the bus until they reset
+def end_fast_session(bus, channel, board_ids, group=0):
+    bus, ok = bl_switch_bitrate(bus, channel, board_ids, DEFAULT_BITRATE, group)
+    if not ok:
+        print(yellow('Could not switch back to the default bit rate. Boards will return to it when they reset.'))
+    return bus
+
+
+# Flash an entire file to the mcu.
+# If base is the image the board is running, changed pages are sent as deltas against it.
+def flash(board_id, filepath, channel=None, interactive=True, window=DEFAULT_WINDOW, full=False, base=None,
+          bitrate=DEFAULT_BITRATE):
+    if interactive and not filepath.endswith('.bin'):
+        response = input('File path does not end in ".bin". Flash anyway? (Y/n): ')
+        if 'n' in response.lower():
+            print('Firmware flashing canceled')
+            exit(0)
+
+    bus = get_can_bus(channel)
+
+    b = load_image(filepath)
+    num_pages = len(b) // PG_SIZE
+    pages, acrc = split_pages(b)
+
+    # Reset & connect to board
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        if interactive:
+            print('Could not connect to board.')
+            exit(1)
+        else:
+            raise RuntimeError('Could not connect to board.')
+
+    caps = bl_get_caps(bus, board_id)
+    staging = bool(caps & BL_CAP_AGENT)
+    max_pages = BACKUP_PAGE_COUNT if staging else APP_PAGE_COUNT
+    if num_pages > max_pages:
+        msg = f'{filepath} uses {num_pages} pages, more than the {max_pages} that fit'
+        if staging:
+            msg += ' into the backup slot for staging. Reset the board into the bootloader to flash it.'
+        if interactive:
+            print(red(msg))
+            exit(1)
+        else:
+            raise RuntimeError(msg)
+    fast = False
+    if bitrate != DEFAULT_BITRATE and not staging:
+        bus, fast = start_fast_session(bus, channel, [board_id], caps, bitrate)
+
+    if staging:
+        print(f'Board {board_id} is running its app. Staging {filepath} for the next reset')
+    else:
+        print(f'Connected to board {board_id}. Uploading {filepath}')
+
+    # Only send pages that differ from what is already on the board
+    changed = range(num_pages)
+    if (caps & BL_CAP_PAGE_CRC) and not full:
+        changed = bl_changed_pages(bus, board_id, pages)
+        print(f'{len(changed)}/{num_pages} pages changed')
+
+    order = sorted(changed)
+    patches = {}
+    if base is not None:
+        old = load_image(base)
+        _, old_crc = split_pages(old)
+        if not caps & BL_CAP_DELTA:
+            print(yellow('Bootloader does not support delta updates. Sending whole pages.'))
+        elif bl_app_info(bus, board_id) != (len(old) // PG_SIZE, old_crc.crcValue):
+            print(yellow(f'Board is not running {base}. Sending whole pages.'))
+        else:
+            order, patches = plan_delta(old, b, changed)
+            print(f'{len(patches)}/{len(order)} pages sent as delta')
+
+    for p in order:
+        pcrc, page_data = pages[p]
+        print(f'Page {p}/{num_pages - 1}', end='')
+        if retry_page(bus, board_id, p, num_pages, pcrc, page_data, caps, window, patches.get(p)):
+            print(" CRC OK")
+        else:
             if interactive:
                 print('Page write failed')
                 exit(1)
             else:
                 raise RuntimeError('Page write failed')
 
+    if not fix_bad_pages(bus, board_id, pages, caps, window):
+        if interactive:
+            print('Page write failed')
+            exit(1)
+        else:
+            raise RuntimeError('Page write failed')
+
     print('Verifying...')
     try:
         bl_cmd_response(bus, board_id, BL_WCRC, num_pages, acrc.digest())
@@ -123,12 +343,121 @@ def flash(board_id, filepath, channel=None, interactive=True):
             print('Verification failed')
             exit(1)
 
-    print("Board flashed successfully")
+    if fast:
+        end_fast_session(bus, channel, [board_id])
+    if staging:
+        print("Image staged. The board installs it when the app resets.")
+    else:
+        print("Board flashed successfully")
+
+
+# Flash the same file to several boards at once by multicasting each page to a group
+def flash_group(group, board_ids, filepath, channel=None, interactive=True, window=DEFAULT_WINDOW, full=False,
+                bitrate=DEFAULT_BITRATE):
+    bus = get_can_bus(channel)
+
+    b = load_image(filepath)
+    num_pages = len(b) // PG_SIZE
+    pages, acrc = split_pages(b)
+
+    caps = {}
+    for board_id in board_ids:
+        print(f'Attempting to connect to board with ID {board_id}')
+        if not bl_wait_for_connection(bus, board_id):
+            if interactive:
+                print(f'Could not connect to board {board_id}.')
+                exit(1)
+            else:
+                raise RuntimeError(f'Could not connect to board {board_id}.')
+        caps[board_id] = bl_get_caps(bus, board_id)
+        if not caps[board_id] & BL_CAP_GROUP:
+            if interactive:
+                print(f'Board {board_id} does not support multicast flashing.')
+                exit(1)
+            else:
+                raise RuntimeError(f'Board {board_id} does not support multicast flashing.')
+        # Put the board in the group. Nothing is erased if it is already a member.
+        bl_cmd_response(bus, board_id, BL_SET_GROUP, group, [0] * 4)
+
+    # Only use features every member supports
+    group_caps = ~0
+    for c in caps.values():
+        group_caps &= c
+
+    fast = False
+    if bitrate != DEFAULT_BITRATE:
+        bus, fast = start_fast_session(bus, channel, board_ids, group_caps, bitrate, group)
+
+    print(f'Connected to boards {board_ids}. Uploading {filepath} to group {group}')
+
+    # Only send pages that differ on at least one board
+    changed = range(num_pages)
+    if (group_caps & BL_CAP_PAGE_CRC) and not full:
+        changed = set()
+        for board_id in board_ids:
+            changed.update(bl_changed_pages(bus, board_id, pages))
+        print(f'{len(changed)}/{num_pages} pages changed')
+
+    for p, (pcrc, page_data) in enumerate(pages):
+        if p not in changed:
+            continue
+        print(f'Page {p}/{num_pages - 1}', end='')
+        stragglers = set(board_ids)
+        try:
+            send_page(bus, group, page_data, group_caps, window, members=board_ids)
+            bl_cmd(bus, group, BL_WPAGE, p, pcrc.digest(), can_id=CANID_BL_GRP_CMD)
+            replies = bl_waitresp_all(bus, board_ids, BL_WPAGE, 0.1)
+            stragglers = {i for i in board_ids if i not in replies or replies[i].data[2] != 0}
+            # Boards still programming the previous page have the data, they just need WRITE_PAGE again
+            for board_id in sorted(i for i in stragglers if replies.get(i) and replies[i].data[2] == BL_ERR_BUSY):
+                bl_cmd_response(bus, board_id, BL_WPAGE, p, pcrc.digest())
+                stragglers.remove(board_id)
+        except RuntimeError as e:
+            print('Error multicasting page: ', e)
+
+        # Patch up boards that didn't get the page one at a time
+        for board_id in sorted(stragglers):
+            print(f' Board {board_id}', end='')
+            if not retry_page(bus, board_id, p, num_pages, pcrc, page_data, caps[board_id], window):
+                if interactive:
+                    print(f'Page write failed on board {board_id}')
+                    exit(1)
+                else:
+                    raise RuntimeError(f'Page write failed on board {board_id}')
+        print(" CRC OK")
+
+    for board_id in board_ids:
+        if not fix_bad_pages(bus, board_id, pages, caps[board_id], window):
+            if interactive:
+                print(f'Page write failed on board {board_id}')
+                exit(1)
+            else:
+                raise RuntimeError(f'Page write failed on board {board_id}')
+
+    print('Verifying...')
+    for board_id in board_ids:
+        try:
+            bl_cmd_response(bus, board_id, BL_WCRC, num_pages, acrc.digest())
+        except RuntimeError as e:
+            if not interactive:
+                raise e  # Just pass on the error
+            else:
+                print(f'Verification failed on board {board_id}')
+                exit(1)
+
+    if fast:
+        end_fast_session(bus, channel, board_ids, group)
+    print("Boards flashed successfully")
 
 
 def multi_flash(clean=False, channel=None):
+    flashed_groups = set()
     # Check that firmware folders exist and build them
     for board in board_firmwares:
+        # Boards in a group are all flashed along with the first member
+        if board.group in flashed_groups:
+            continue
+
         print('\n\n')
         print(green(f'Building firmware for {board.name}'))
         if not board.fw_path.exists():
@@ -164,15 +493,27 @@ def multi_flash(clean=False, channel=None):
             print(red(f'Could not find firmware binary at {fw_binary_path}.'))
             exit(4)
 
-        print(f"Flashing binary {fw_binary_path} to board #{board.board_id}")
+        members = [board]
+        if board.group != 0:
+            members = [b for b in board_firmwares if b.group == board.group]
+            if any(m.fw_path != board.fw_path for m in members):
+                print(red(f'Boards in group {board.group} must all use the same firmware.'))
+                exit(1)
+            flashed_groups.add(board.group)
+
+        print(f"Flashing binary {fw_binary_path} to board(s) {', '.join(f'#{m.board_id}' for m in members)}")
         flashed = False
 
         # Try up to 3 times to flash
         for _i in range(3):
             try:
-                flash(board.board_id, fw_binary_path, channel=channel, interactive=False)
+                if board.group != 0:
+                    flash_group(board.group, [m.board_id for m in members], fw_binary_path, channel=channel,
+                                interactive=False)
+                else:
+                    flash(board.board_id, fw_binary_path, channel=channel, interactive=False)
                 flashed = True
-                print(green(f'Successfully flashed {board.name}'))
+                print(green(f'Successfully flashed {", ".join(m.name for m in members)}'))
                 break
             except RuntimeError as e:
                 print(yellow(f'Failed to flash board: {e}'))
@@ -204,12 +545,308 @@ def change_id(board_id, new_id, channel=None):
     print('Successfully changed board ID')
 
 
+def set_group(board_id, group, channel=None):
+    if group < 0 or group > 255:
+        print('Invalid group. Choose a group from 1-255, or 0 to leave the group.')
+        exit(1)
+
+    bus = get_can_bus(channel)
+
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    print(f'Setting group of board {board_id} to {group}...')
+    bl_cmd_response(bus, board_id, BL_SET_GROUP, group, [0] * 4)
+
+    print('Successfully changed group')
+
+
+def set_boot_window(board_id, window_ms, channel=None):
+    if window_ms < 0 or window_ms > 0xFFFF:
+        print('Invalid boot window. Choose a window from 0-65535 ms.')
+        exit(1)
+
+    bus = get_can_bus(channel)
+
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    if not bl_get_caps(bus, board_id) & BL_CAP_FAST_BOOT:
+        print('Bootloader always listens for 200 ms after power-on.')
+        exit(1)
+    print(f'Setting boot window of board {board_id} to {window_ms} ms...')
+    bl_cmd_response(bus, board_id, BL_SET_BOOT_WINDOW, window_ms, [0] * 4)
+
+    print('Successfully changed boot window')
+
+
+def set_crc_interval(board_id, boots, channel=None):
+    if boots < 0 or boots > CRC_INTERVAL_MAX:
+        print(f'Invalid interval. Choose an interval from 1-{CRC_INTERVAL_MAX} boots, or 0 for the default.')
+        exit(1)
+
+    bus = get_can_bus(channel)
+
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    if not bl_get_caps(bus, board_id) & BL_CAP_CRC_INTERVAL:
+        print('Bootloader checks the app CRC on every boot.')
+        exit(1)
+    print(f'Setting CRC interval of board {board_id} to {boots} boots...')
+    bl_cmd_response(bus, board_id, BL_SET_CRC_INTERVAL, boots, [0] * 4)
+
+    print('Successfully changed CRC interval')
+
+
+def show_stats(board_id, clear=False, channel=None):
+    bus = get_can_bus(channel)
+
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    if not bl_get_caps(bus, board_id) & BL_CAP_STATS:
+        print('Bootloader does not keep statistics.')
+        exit(1)
+
+    ring_max, ring_drops, fifo_overruns = bl_stats(bus, board_id, clear, STATS_RX)
+    print(f'Most frames queued:      {ring_max}')
+    print(f'Frames dropped (queue):  {ring_drops}')
+    print(f'CAN FIFO overruns:       {fifo_overruns}')
+    ring_max, ring_drops, _ = bl_stats(bus, board_id, clear, STATS_TX)
+    print(f'Most replies queued:     {ring_max}')
+    print(f'Replies dropped (queue): {ring_drops}')
+
+
+RESET_FLAGS = {31: 'low power', 30: 'window watchdog', 29: 'watchdog', 28: 'software', 27: 'power-on',
+               26: 'reset pin'}
+CFSR_FLAGS = {0: 'IACCVIOL', 1: 'DACCVIOL', 3: 'MUNSTKERR', 4: 'MSTKERR', 7: 'MMARVALID', 8: 'IBUSERR', 9: 'PRECISERR',
+              10: 'IMPRECISERR', 11: 'UNSTKERR', 12: 'STKERR', 15: 'BFARVALID', 16: 'UNDEFINSTR', 17: 'INVSTATE',
+              18: 'INVPC', 19: 'NOCP', 24: 'UNALIGNED', 25: 'DIVBYZERO'}
+HFSR_FLAGS = {1: 'VECTTBL', 30: 'FORCED', 31: 'DEBUGEVT'}
+
+
+def flag_names(value, names):
+    return ', '.join(name for bit, name in sorted(names.items()) if value & (1 << bit)) or 'none'
+
+
+# Show the crash record a board kept from the last time its app faulted or the watchdog reset it
+def show_crash(board_id, clear=False, channel=None):
+    bus = get_can_bus(channel)
+
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    if not bl_get_caps(bus, board_id) & BL_CAP_CRASH:
+        print('Bootloader does not keep crash records.')
+        exit(1)
+
+    record = bl_read_crash(bus, board_id)
+    if record is None:
+        print('No crash recorded since power-on.')
+    else:
+        _, reset_csr, exc_return, sp, cfsr, hfsr, mmfar, bfar = record[:8]
+        frame = record[8:16]
+        print(f'Reset reason: {flag_names(reset_csr, RESET_FLAGS)}')
+        if exc_return == 0:
+            print('No fault was caught. The app hung until the watchdog reset it.')
+        else:
+            print(f'CFSR:  0x{cfsr:08x} ({flag_names(cfsr, CFSR_FLAGS)})')
+            print(f'HFSR:  0x{hfsr:08x} ({flag_names(hfsr, HFSR_FLAGS)})')
+            if cfsr & (1 << 7):
+                print(f'MMFAR: 0x{mmfar:08x}')
+            if cfsr & (1 << 15):
+                print(f'BFAR:  0x{bfar:08x}')
+            print(f'EXC_RETURN: 0x{exc_return:08x} ({"process" if exc_return & 4 else "main"} stack)')
+            for name, value in zip(('r0', 'r1', 'r2', 'r3', 'r12', 'lr', 'pc', 'xpsr'), frame):
+                print(f'{name + ":":5} 0x{value:08x}')
+            print(f'sp:   0x{sp:08x}')
+            stack = record[16:]
+            for i in range(0, len(stack), 4):
+                print(f'  0x{sp + i * 4:08x}: ' + ' '.join(f'{w:08x}' for w in stack[i:i + 4]))
+
+    if clear:
+        bl_cmd_response(bus, board_id, BL_READ_CRASH, 1, [0] * 4)
+        print('Crash record cleared')
+
+
+# Load a RAM stub into a board and run it. The stub goes through the page buffer like a page of the app.
+def run_stub(board_id, filepath, entry=0, arg=0, timeout=1.0, channel=None, window=DEFAULT_WINDOW):
+    with open(filepath, 'rb') as f:
+        blob = bytearray(f.read())
+    blob.extend(bytearray(-len(blob) % 8))  # Whole dense frames
+    if len(blob) > STUB_SIZE:
+        print(f'{filepath} is larger than the {STUB_SIZE} bytes of stub RAM.')
+        exit(1)
+
+    bus = get_can_bus(channel)
+
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    caps = bl_get_caps(bus, board_id)
+    if not caps & BL_CAP_STUB:
+        print('Bootloader cannot run stubs.')
+        exit(1)
+
+    print(f'Loading {filepath} ({len(blob)} bytes)', end='')
+    send_page_windowed(bus, board_id, to_words(blob), caps, window)
+    bl_cmd(bus, board_id, BL_LOAD_STUB, len(blob) // 4, bl_crc(blob).to_bytes(4, 'big'))
+    m = bl_waitresp_msg(bus, board_id, BL_LOAD_STUB, 0.1)
+    if m is None or m.data[2] > 0:
+        print(red(' failed'))
+        exit(1)
+    print(f' at 0x{int.from_bytes(m.data[4:8], "little"):08x}')
+
+    bl_cmd(bus, board_id, BL_RUN_STUB, entry, arg.to_bytes(4, 'big'))
+    m = bl_waitresp_msg(bus, board_id, BL_RUN_STUB, timeout)
+    if m is None:
+        print(red(f'Stub did not return within {timeout} s'))
+        exit(1)
+    if m.data[2] > 0:
+        print(red(f'Bootloader command {BL_RUN_STUB} error #{m.data[2]}'))
+        exit(1)
+    print(f'Stub returned {m.data[3]}, result 0x{int.from_bytes(m.data[4:8], "little"):08x}')
+
+
+def print_read_progress(done, count):
+    print(f'\rRead {done * 4}/{count * 4} bytes', end='' if done < count else '\n')
+
+
+# Connect to a board that can read flash back, at bitrate if possible. Returns the bus and whether it is a fast session.
+def connect_for_read(board_id, channel, bitrate):
+    bus = get_can_bus(channel)
+
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    caps = bl_get_caps(bus, board_id)
+    if not caps & BL_CAP_READ_MEM:
+        print('Bootloader cannot read flash back.')
+        exit(1)
+    fast = False
+    if bitrate != DEFAULT_BITRATE:
+        bus, fast = start_fast_session(bus, channel, [board_id], caps, bitrate)
+    return bus, fast
+
+
+# Read the app back from a board and compare it with an image, page by page
+def verify(board_id, filepath, channel=None, bitrate=DEFAULT_BITRATE):
+    b = load_image(filepath)
+    num_pages = len(b) // PG_SIZE
+    if num_pages > APP_PAGE_COUNT:
+        print(f'{filepath} does not fit into the app region.')
+        exit(1)
+
+    bus, fast = connect_for_read(board_id, channel, bitrate)
+    data = bl_read_mem(bus, board_id, READ_PAGE_WORDS, len(b) // 4, progress=print_read_progress)
+    if fast:
+        end_fast_session(bus, channel, [board_id])
+
+    bad = [p for p in range(num_pages) if data[p * PG_SIZE:(p + 1) * PG_SIZE] != b[p * PG_SIZE:(p + 1) * PG_SIZE]]
+    if bad:
+        print(red(f'{len(bad)}/{num_pages} pages differ from {filepath}: {", ".join(str(p) for p in bad)}'))
+        exit(1)
+    print(green(f'Board {board_id} matches {filepath}'))
+
+
+# Save the app (or the settings page) of a board to a file. By default as many pages as the installed app uses.
+def dump(board_id, filepath, channel=None, num_pages=None, settings=False, bitrate=DEFAULT_BITRATE):
+    bus, fast = connect_for_read(board_id, channel, bitrate)
+
+    if settings:
+        first_word, num_pages = 0, 1
+    else:
+        first_word = READ_PAGE_WORDS
+        if num_pages is None:
+            info = bl_app_info(bus, board_id)
+            num_pages = info[0] if info is not None else APP_PAGE_COUNT
+        if not 1 <= num_pages <= APP_PAGE_COUNT:
+            print(f'Invalid page count. Choose 1-{APP_PAGE_COUNT} pages.')
+            exit(1)
+
+    print(f'Reading {num_pages} pages from board {board_id}...')
+    data = bl_read_mem(bus, board_id, first_word, num_pages * READ_PAGE_WORDS, progress=print_read_progress)
+    if fast:
+        end_fast_session(bus, channel, [board_id])
+
+    with open(filepath, 'wb') as f:
+        f.write(data)
+    print(f'Saved to {filepath}')
+
+
+# Update the bootloader of a board over CAN. The image is staged in the backup slot, then the board's boot stage copies
+# it into place. Page 0 (the boot stage) has to be the same in the old and the new bootloader.
+def update_bl(board_id, filepath, channel=None, window=DEFAULT_WINDOW):
+    b = load_image(filepath)
+    num_pages = len(b) // PG_SIZE
+    if num_pages > BL_PAGE_COUNT:
+        print(f'{filepath} is larger than the {BL_PAGE_COUNT} pages a bootloader may use.')
+        exit(1)
+    pages, acrc = split_pages(b)
+
+    bus = get_can_bus(channel)
+    print(f'Attempting to connect to board with ID {board_id}')
+    if not bl_wait_for_connection(bus, board_id):
+        print('Could not connect to board.')
+        exit(1)
+    caps = bl_get_caps(bus, board_id)
+    if not caps & BL_CAP_UPDATE_BL:
+        print('Bootloader cannot update itself. Use flash_bl.')
+        exit(1)
+    # The image is staged in the backup slot, which a big app runs into
+    info = bl_app_info(bus, board_id)
+    if info is not None and info[0] > BACKUP_FIRST_PAGE:
+        print(red(f'The app on board {board_id} uses {info[0]} pages and runs into the backup slot, where the new '
+                  f'bootloader would be staged. Use flash_bl, or flash an app of at most {BACKUP_FIRST_PAGE} pages.'))
+        exit(1)
+
+    # Pages from BACKUP_FIRST_PAGE on are the backup slot
+    print(f'Staging {filepath} on board {board_id}')
+    for p in bl_changed_pages(bus, board_id, pages, BACKUP_FIRST_PAGE):
+        pcrc, page_data = pages[p]
+        print(f'Page {p}/{num_pages - 1}', end='')
+        if not retry_page(bus, board_id, BACKUP_FIRST_PAGE + p, num_pages, pcrc, page_data, caps, window):
+            print('Page write failed')
+            exit(1)
+        print(" CRC OK")
+    if bl_changed_pages(bus, board_id, pages, BACKUP_FIRST_PAGE):
+        print('Page write failed')
+        exit(1)
+
+    print('Updating bootloader...')
+    try:
+        bl_cmd_response(bus, board_id, BL_UPDATE_BL, num_pages, acrc.digest())
+    except RuntimeError as e:
+        if f'error #{BL_ERR_BOOT_STAGE}' in str(e):
+            print(red('The new bootloader changes the boot stage in page 0. Use flash_bl.'))
+        else:
+            print(red(f'Update failed: {e}'))
+        exit(1)
+
+    # The board copies the pages and comes back waiting for the flasher
+    time.sleep(0.5)
+    if not bl_wait_for_connection(bus, board_id, retries=30):
+        print(red('Board did not come back after the update. If a page would not copy, the board runs its app without a '
+                  'bootloader (or keeps retrying); use flash_bl.'))
+        exit(1)
+    print(green(f'Bootloader of board {board_id} updated'))
+
+
 def flash_bl():
     if platform == 'win32':
         print('Unable to build/flash bootloader on Windows. Do it manually through VSCode instead.')
         return
-    # Clean build to give a fresh build timestamp for the bootloader
-    # This prevents new bootloaders from running old apps
+    # Clean build, so nothing stale ends up in the bootloader
+    # Only the bootloader pages are erased. The new bootloader takes over the vars of one with the vars header in full,
+    # from older ones only the board ID and the app.
     subprocess.run(('make', '-C', '../', '-f', 'STM32Make.make', 'clean'))
     # Build & flash MCU
     subprocess.run(('make', '-C', '../', '-f', 'STM32Make.make', 'flash', '-j4'))
@@ -229,6 +866,25 @@ def main():
     flash_parser = subparsers.add_parser('flash', help='Flash a board')
     flash_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
     flash_parser.add_argument('filepath', nargs='?', help='Path to the .bin file to be flashed')
+    flash_parser.add_argument('-w', '--window', type=int, default=DEFAULT_WINDOW,
+                              help=f'Words sent before checking for lost frames (Defaults to {DEFAULT_WINDOW})')
+    flash_parser.add_argument('--full', action='store_true', help='Rewrite every page, even unchanged ones')
+    flash_parser.add_argument('--base', type=str,
+                              help='Image currently on the board. Changed pages are sent as deltas against it.')
+    flash_parser.add_argument('--bitrate', type=int, choices=sorted(BL_BITRATES), default=DEFAULT_BITRATE,
+                              help='CAN bit rate for the flashing session (slcan only)')
+
+    # Group flash sub-parser
+    flash_group_parser = subparsers.add_parser('flash_group', help='Flash the same file to several boards at once')
+    flash_group_parser.add_argument('-g', '--group', type=int, help='Multicast group ID (1-255)', required=True)
+    flash_group_parser.add_argument('-b', '--boards', type=int, nargs='+', help='Board IDs in the group',
+                                    required=True)
+    flash_group_parser.add_argument('-w', '--window', type=int, default=DEFAULT_WINDOW,
+                                    help=f'Words sent before checking for lost frames (Defaults to {DEFAULT_WINDOW})')
+    flash_group_parser.add_argument('--full', action='store_true', help='Rewrite every page, even unchanged ones')
+    flash_group_parser.add_argument('--bitrate', type=int, choices=sorted(BL_BITRATES), default=DEFAULT_BITRATE,
+                                    help='CAN bit rate for the flashing session (slcan only)')
+    flash_group_parser.add_argument('filepath', help='Path to the .bin file to be flashed')
 
     # Multi-flash sub-parser
     flash_all_parser = subparsers.add_parser('flash_all', help='Flash all known boards')
@@ -240,6 +896,70 @@ def main():
     change_id_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
     change_id_parser.add_argument('-i', '--id', type=int, help='new ID for the board', required=True)
 
+    # Set group sub-parser
+    set_group_parser = subparsers.add_parser('set_group', help='Change the multicast group of a board')
+    set_group_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    set_group_parser.add_argument('-g', '--group', type=int, help='new group for the board (0 = none)',
+                                  required=True)
+
+    # Set boot window sub-parser
+    boot_window_parser = subparsers.add_parser('set_boot_window',
+                                               help='Set how long a board waits for the flasher after power-on')
+    boot_window_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    boot_window_parser.add_argument('-t', '--time', type=int, help='Milliseconds to wait (0 = start the app at once)',
+                                    required=True)
+
+    # Set CRC interval sub-parser
+    crc_interval_parser = subparsers.add_parser('set_crc_interval',
+                                                help='Set how many boots apart a board checks the whole app CRC')
+    crc_interval_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    crc_interval_parser.add_argument('-n', '--boots', type=int,
+                                     help='Boots between full checks (1 = every boot, 0 = default of 16)',
+                                     required=True)
+
+    # Stats sub-parser
+    stats_parser = subparsers.add_parser('stats', help='Show receive and transmit statistics of a board')
+    stats_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    stats_parser.add_argument('--clear', action='store_true', help='Clear the counters after reading them')
+
+    # Verify sub-parser
+    verify_parser = subparsers.add_parser('verify', help='Compare the app on a board with a file')
+    verify_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    verify_parser.add_argument('--bitrate', type=int, choices=sorted(BL_BITRATES), default=DEFAULT_BITRATE,
+                               help='CAN bit rate for reading (slcan only)')
+    verify_parser.add_argument('filepath', help='Path to the .bin file to compare with')
+
+    # Dump sub-parser
+    dump_parser = subparsers.add_parser('dump', help='Save the app on a board to a file')
+    dump_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    dump_parser.add_argument('-p', '--pages', type=int,
+                             help='Pages to read (Defaults to the size of the installed app, or the whole region)')
+    dump_parser.add_argument('--settings', action='store_true', help='Save the settings page instead of the app')
+    dump_parser.add_argument('--bitrate', type=int, choices=sorted(BL_BITRATES), default=DEFAULT_BITRATE,
+                             help='CAN bit rate for reading (slcan only)')
+    dump_parser.add_argument('filepath', help='Path to the .bin file to write')
+
+    # Run stub sub-parser
+    stub_parser = subparsers.add_parser('run_stub', help='Load code into the RAM of a board and run it')
+    stub_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    stub_parser.add_argument('-e', '--entry', type=lambda s: int(s, 0), default=0,
+                             help='Entry point as a byte offset into the stub (Defaults to 0)')
+    stub_parser.add_argument('-a', '--arg', type=lambda s: int(s, 0), default=0, help='Argument passed to the stub')
+    stub_parser.add_argument('-t', '--timeout', type=float, default=1.0,
+                             help='Seconds to wait for the stub to return (Defaults to 1)')
+    stub_parser.add_argument('filepath', help='Path to the .bin file of the stub')
+
+    # Crash sub-parser
+    crash_parser = subparsers.add_parser('crash', help='Show the crash record of a board')
+    crash_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    crash_parser.add_argument('--clear', action='store_true', help='Clear the record after reading it')
+
+    # Update bootloader sub-parser
+    update_bl_parser = subparsers.add_parser('update_bl', help='Update the bootloader of a board over CAN')
+    update_bl_parser.add_argument('-b', '--board', type=int, help='Integer input for board ID', required=True)
+    update_bl_parser.add_argument('filepath', nargs='?', default='../build/CAN_Bootloader.bin',
+                                  help='Path to the .bin file of the new bootloader (Defaults to ../build/CAN_Bootloader.bin)')
+
     # List sub-parser
     list_parser = subparsers.add_parser('list', help='List connected boards')
 
@@ -250,13 +970,43 @@ def main():
             print("Error: filepath is required for flash command")
             flash_parser.print_help()
             return
-        flash(args.board, args.filepath, channel=args.channel)
+        if not 1 <= args.window <= PG_SIZE // 4:
+            print(f'Invalid window. Choose a window from 1-{PG_SIZE // 4}.')
+            return
+        flash(args.board, args.filepath, channel=args.channel, window=args.window, full=args.full, base=args.base,
+              bitrate=args.bitrate)
+    elif args.command == 'flash_group':
+        if not 1 <= args.group <= 255:
+            print('Invalid group. Choose a group from 1-255.')
+            return
+        flash_group(args.group, args.boards, args.filepath, channel=args.channel, window=args.window,
+                    full=args.full, bitrate=args.bitrate)
     elif args.command == 'flash_bl':
         flash_bl()
     elif args.command == 'flash_all':
         multi_flash(clean=args.clean, channel=args.channel)
     elif args.command == 'change_id':
         change_id(args.board, args.id, channel=args.channel)
+    elif args.command == 'set_group':
+        set_group(args.board, args.group, channel=args.channel)
+    elif args.command == 'set_boot_window':
+        set_boot_window(args.board, args.time, channel=args.channel)
+    elif args.command == 'set_crc_interval':
+        set_crc_interval(args.board, args.boots, channel=args.channel)
+    elif args.command == 'stats':
+        show_stats(args.board, args.clear, channel=args.channel)
+    elif args.command == 'verify':
+        verify(args.board, args.filepath, channel=args.channel, bitrate=args.bitrate)
+    elif args.command == 'dump':
+        dump(args.board, args.filepath, channel=args.channel, num_pages=args.pages, settings=args.settings,
+             bitrate=args.bitrate)
+    elif args.command == 'run_stub':
+        run_stub(args.board, args.filepath, entry=args.entry, arg=args.arg, timeout=args.timeout,
+                 channel=args.channel)
+    elif args.command == 'crash':
+        show_crash(args.board, args.clear, channel=args.channel)
+    elif args.command == 'update_bl':
+        update_bl(args.board, args.filepath, channel=args.channel)
     elif args.command == 'list':
         list_connected_boards(channel=args.channel)
     else:
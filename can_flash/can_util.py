@@ -1,9 +1,15 @@
 import datetime
+import time
 from sys import platform
 
 import can
+import crcmod
 
 PG_SIZE = 1024  # Page size in bytes
+APP_PAGE_COUNT = 51  # Pages in the app region, the last page of flash holds the boot tally
+BACKUP_PAGE_COUNT = 25  # Upper half of the app region, the backup slot while the app fits into the lower half
+BACKUP_FIRST_PAGE = APP_PAGE_COUNT - BACKUP_PAGE_COUNT
+BL_PAGE_COUNT = 11  # Pages a bootloader image may use, the settings page follows
 
 # Bootloader commands
 BL_WBUF = 1
@@ -11,10 +17,85 @@ BL_WPAGE = 2
 BL_WCRC = 3
 BL_PING = 4
 BL_SET_ID = 5
+BL_STREAM_BUF = 6
+BL_BUF_STATUS = 7
+BL_SET_GROUP = 8
+BL_PAGE_CRC = 9
+BL_DECOMPRESS = 10
+BL_APP_INFO = 11
+BL_STATS = 12
+BL_BITRATE = 13
+BL_SET_BOOT_WINDOW = 14
+BL_SET_CRC_INTERVAL = 15
+BL_READ_MEM = 16
+BL_READ_CREDIT = 17
+BL_READ_CRASH = 18
+BL_LOAD_STUB = 19
+BL_RUN_STUB = 20
+BL_UPDATE_BL = 21
+
+# Bootloader error codes
+BL_ERR_FLASH_WRITE = 3
+BL_ERR_INVALID_OFFSET = 5
+BL_ERR_BUSY = 7  # Still programming the previous page
+BL_ERR_BOOT_STAGE = 9  # The new bootloader has a different boot stage in page 0
+
+BUSY_RETRIES = 400  # Enough for the backup a board takes before the first page of an update (about 1.5 s)
+BUSY_DELAY_SEC = 0.005
+
+# CAN bit rates and their codes for BL_BITRATE. Boards always start at DEFAULT_BITRATE.
+DEFAULT_BITRATE = 500000
+BL_BITRATES = {500000: 0, 1000000: 1}
+BITRATE_SETTLE_SEC = 0.05  # Boards switch 20 ms after the command
+BITRATE_FALLBACK_SEC = 0.6  # Boards go back to DEFAULT_BITRATE after 500 ms without a frame at the new rate
+
+# Capability flags reported in the ping reply
+BL_CAP_STREAM = 0x01  # BL_STREAM_BUF supported (no reply per word)
+BL_CAP_SACK = 0x02  # BL_BUF_STATUS supported (bitmap of missing words)
+BL_CAP_DENSE = 0x04  # Dense extended ID data frames supported
+BL_CAP_GROUP = 0x08  # Multicast groups supported
+BL_CAP_PAGE_CRC = 0x10  # BL_PAGE_CRC supported
+BL_CAP_LZ4 = 0x20  # BL_DECOMPRESS and BL_DATA_ZBUF frames supported
+BL_CAP_DELTA = 0x40  # BL_DECOMPRESS takes a flash dictionary, BL_APP_INFO supported
+BL_CAP_STATS = 0x80  # BL_STATS supported
+BL_CAP_BITRATE = 0x100  # BL_BITRATE supported
+BL_CAP_FAST_BOOT = 0x200  # Power-on starts the app right away, BL_SET_BOOT_WINDOW supported
+BL_CAP_CRC_INTERVAL = 0x400  # Full app CRC only every few boots, BL_SET_CRC_INTERVAL supported
+BL_CAP_READ_MEM = 0x800  # BL_READ_MEM and BL_READ_CREDIT supported
+BL_CAP_CRASH = 0x1000  # Crash records kept, BL_READ_CRASH supported
+BL_CAP_STUB = 0x2000  # BL_LOAD_STUB and BL_RUN_STUB supported
+BL_CAP_ROLLBACK = 0x4000  # Backup slot, crashing new apps are rolled back
+BL_CAP_AGENT = 0x8000  # The app's download agent replied, not the bootloader. Images are staged for the next reset.
+BL_CAP_UPDATE_BL = 0x10000  # BL_UPDATE_BL supported, BL_WPAGE also writes the backup slot
+
+CRC_INTERVAL_MAX = 64  # Longest BL_SET_CRC_INTERVAL the bootloader takes
 
 # Bootload CAN IDs
 CANID_BL_CMD = 0x700
 CANID_BL_RPL_BASE = 0x701
+CANID_BL_GRP_CMD = 0x6FF  # Page transfer commands addressed to a multicast group
+
+# Dense data frames: 0x1B7 in bits 28-20, frame type in bits 19-16, board ID in bits 15-8, word offset in bits 7-0
+CANID_BL_DATA_EXT = 0x1B700000
+
+# Dense data frame types. OR with BL_DATA_GROUP to address a multicast group.
+BL_DATA_GROUP = 0x1
+BL_DATA_PAGE = 0
+BL_DATA_GROUP_PAGE = BL_DATA_PAGE | BL_DATA_GROUP
+BL_DATA_ZBUF = 2  # LZ4 compressed page data
+BL_DATA_READ = 4  # Flash read back by BL_READ_MEM, sent by the board. The offset is the frame number.
+
+# BL_READ_MEM word offsets: the settings page is at 0, app page p at (p + 1) * READ_PAGE_WORDS
+READ_PAGE_WORDS = PG_SIZE // 4
+READ_WINDOW = 16  # Frames the board sends for BL_READ_MEM before it needs BL_READ_CREDIT
+DEFAULT_READ_CREDIT = 64  # Frames granted ahead of the last one received
+
+# Crash record (struct crash_record_t in main.h), read with BL_READ_CRASH
+CRASH_MAGIC = 0xc4a5b10c
+CRASH_STACK_WORDS = 32
+CRASH_WORDS = 16 + CRASH_STACK_WORDS
+
+STUB_SIZE = PG_SIZE  # Bytes of stub RAM
 
 
 # Check whether a message is a bootloader response
@@ -23,15 +104,15 @@ def is_bl_response_id(id):
 
 
 # Create CAN message from id & data
-def canmsg(id, data):
+def canmsg(id, data, extended=False):
     if len(data) > 8:
         raise ValueError("invalid data")
-    m = can.Message(arbitration_id=id, is_extended_id=False, data=data)
+    m = can.Message(arbitration_id=id, is_extended_id=extended, data=data)
     return m
 
 
-# Create bootloader CAN message
-def bl_cmd(bus, board_id, cmd, par1, par2):
+# Create bootloader CAN message. Send to CANID_BL_GRP_CMD with a group ID in place of board_id to multicast.
+def bl_cmd(bus, board_id, cmd, par1, par2, can_id=CANID_BL_CMD):
     # Create data for CAN message
     data = bytearray(8)
     data[0] = board_id
@@ -39,32 +120,234 @@ def bl_cmd(bus, board_id, cmd, par1, par2):
     data[2:4] = par1.to_bytes(2, 'little')
     data[4:8] = par2[::-1]
 
-    bus.send(canmsg(CANID_BL_CMD, data), 1.0)
+    bus.send(canmsg(can_id, data), 1.0)
 
 
-# Wait for a bootloader response
-def bl_waitresp(bus, board_id, bl_cmd, timeout):
+# Send a dense data frame. Addressing is in the extended ID, so all 8 bytes are data.
+def bl_data(bus, board_id, frame_type, offset, data):
+    can_id = CANID_BL_DATA_EXT | (frame_type << 16) | (board_id << 8) | offset
+    bus.send(canmsg(can_id, data, extended=True), 1.0)
+
+
+# Whether m is a reply to bl_cmd. If tag is given, byte 3 has to match it, which tells replies to an earlier command apart.
+def is_bl_reply(m, bl_cmd, tag=None):
+    if not is_bl_response_id(m.arbitration_id) or m.dlc < 3 or m.data[1] != bl_cmd:
+        return False
+    return tag is None or (m.dlc >= 4 and m.data[3] == tag)
+
+
+# Wait for a bootloader response message
+def bl_waitresp_msg(bus, board_id, bl_cmd, timeout, tag=None):
     absto = datetime.datetime.now() + datetime.timedelta(seconds=timeout)
     while datetime.datetime.now() < absto:
         m = bus.recv(timeout)
         if m is not None:
-            if (is_bl_response_id(m.arbitration_id)) and (m.dlc >= 3) and (m.data[0] == board_id) and (m.data[1] == bl_cmd):
-                return m.data[2]
+            if is_bl_reply(m, bl_cmd, tag) and (m.data[0] == board_id):
+                return m
     return None
 
 
-def bl_cmd_response(bus, board_id, cmd, par1, par2, timeout_sec=0.05, retries=10):
+# Wait for a bootloader response
+def bl_waitresp(bus, board_id, bl_cmd, timeout):
+    m = bl_waitresp_msg(bus, board_id, bl_cmd, timeout)
+    if m is None:
+        return None
+    return m.data[2]
+
+
+# Collect replies to a command from several boards. Returns {board_id: message} for the boards that replied.
+def bl_waitresp_all(bus, board_ids, bl_cmd, timeout, tag=None):
+    replies = {}
+    absto = datetime.datetime.now() + datetime.timedelta(seconds=timeout)
+    while datetime.datetime.now() < absto and len(replies) < len(board_ids):
+        m = bus.recv(timeout)
+        if m is not None:
+            if is_bl_reply(m, bl_cmd, tag) and (m.data[0] in board_ids):
+                replies[m.data[0]] = m
+    return replies
+
+
+def bl_cmd_response(bus, board_id, cmd, par1, par2, timeout_sec=0.05, retries=10, busy_retries=BUSY_RETRIES):
     if retries == 0:
         raise RuntimeError('Did not receive reply from board')
     bl_cmd(bus, board_id, cmd, par1, par2)
-    r = bl_waitresp(bus, board_id, cmd, timeout_sec)
-    if r is None:
-        return bl_cmd_response(bus, board_id, cmd, par1, par2, timeout_sec, retries - 1)
+    m = bl_waitresp_msg(bus, board_id, cmd, timeout_sec)
+    if m is None:
+        return bl_cmd_response(bus, board_id, cmd, par1, par2, timeout_sec, retries - 1, busy_retries)
+    r = m.data[2]
+    if r == BL_ERR_BUSY and busy_retries > 0:
+        # The board is still programming the previous page
+        time.sleep(BUSY_DELAY_SEC)
+        return bl_cmd_response(bus, board_id, cmd, par1, par2, timeout_sec, retries, busy_retries - 1)
+    if r == BL_ERR_FLASH_WRITE and m.dlc >= 4:
+        # Pages are programmed after WRITE_PAGE replies, so failures show up in the reply to a later command
+        raise RuntimeError(f'Bootloader failed to program page {m.data[3]}')
     if r > 0:
         raise RuntimeError(f'Bootloader command {cmd} error #{r}')
     return r
 
 
+# Ask which words of the page buffer the board is missing, in the 32 words starting at first_word. Replies carry the
+# offset they report on, so a late reply to an earlier query is skipped.
+def bl_missing_words(bus, board_id, first_word, timeout_sec=0.05, retries=10):
+    for i in range(retries):
+        bl_cmd(bus, board_id, BL_BUF_STATUS, first_word, [0] * 4)
+        m = bl_waitresp_msg(bus, board_id, BL_BUF_STATUS, timeout_sec, tag=first_word)
+        if m is not None:
+            if m.data[2] > 0:
+                raise RuntimeError(f'Bootloader command {BL_BUF_STATUS} error #{m.data[2]}')
+            bitmap = int.from_bytes(m.data[4:8], 'little')
+            return [first_word + b for b in range(32) if bitmap & (1 << b)]
+    raise RuntimeError('Did not receive reply from board')
+
+
+# Same as bl_missing_words, but for every member of a group. Returns the union of missing words.
+def bl_group_missing_words(bus, group, board_ids, first_word, timeout_sec=0.05):
+    bl_cmd(bus, group, BL_BUF_STATUS, first_word, [0] * 4, can_id=CANID_BL_GRP_CMD)
+    replies = bl_waitresp_all(bus, board_ids, BL_BUF_STATUS, timeout_sec, tag=first_word)
+    missing = set()
+    for board_id in board_ids:
+        if board_id in replies and replies[board_id].data[2] == 0:
+            bitmap = int.from_bytes(replies[board_id].data[4:8], 'little')
+            missing.update(first_word + b for b in range(32) if bitmap & (1 << b))
+        else:
+            # Lost reply, ask this board directly
+            missing.update(bl_missing_words(bus, board_id, first_word, timeout_sec))
+    return sorted(missing)
+
+
+# CRC of data as the bootloader's CRC unit computes it: CRC-32/MPEG-2 over words, most significant byte first
+def bl_crc(data):
+    crc = crcmod.Crc(0x104c11db7, initCrc=0xffffffff, rev=False)
+    for a in range(0, len(data), 4):
+        crc.update(data[a:a + 4][::-1])
+    return crc.crcValue
+
+
+# One BL_READ_MEM (or BL_READ_CRASH) request. Returns the data, or None if a frame was lost or the board was busy, so
+# it can be read again. Every frame received grants the board another one, credit frames ahead.
+def bl_read_chunk(bus, board_id, first_word, count, credit, timeout_sec, cmd=BL_READ_MEM):
+    bl_cmd(bus, board_id, cmd, first_word, count.to_bytes(4, 'big'))
+    data_id = CANID_BL_DATA_EXT | (BL_DATA_READ << 16) | (board_id << 8)
+    data = bytearray()
+    frames = 0
+    granted = READ_WINDOW
+    while True:
+        m = bus.recv(timeout_sec)
+        if m is None:
+            return None
+        if m.is_extended_id and (m.arbitration_id & ~0xFF) == data_id:
+            if frames == 0 and m.arbitration_id != data_id:
+                continue  # Still in flight from a read that was given up on
+            if m.arbitration_id != data_id | (frames & 0xFF):
+                return None  # Lost a frame
+            data += m.data[:m.dlc]
+            frames += 1
+            # Top up in batches, so the credit commands don't take much of the bus
+            if granted - frames <= credit // 2:
+                granted = frames + credit
+                bl_cmd(bus, board_id, BL_READ_CREDIT, granted, [0] * 4)
+        elif (is_bl_response_id(m.arbitration_id)) and (m.dlc >= 3) and (m.data[0] == board_id) and (m.data[1] == cmd):
+            if m.data[2] == BL_ERR_BUSY:
+                time.sleep(BUSY_DELAY_SEC)
+                return None
+            if m.data[2] > 0:
+                raise RuntimeError(f'Bootloader command {cmd} error #{m.data[2]}')
+            if frames == 0:
+                continue  # End of a read that was given up on
+            if m.data[3] != frames & 0xFF or len(data) != count * 4:
+                return None  # Lost frames at the end
+            if int.from_bytes(m.data[4:8], 'little') != bl_crc(data):
+                return None
+            return data
+
+
+# Read count words of flash starting at first_word (see READ_PAGE_WORDS), in flash byte order. The range is read a page
+# at a time, and a page that was lost or doesn't match the CRC the board sends after it is read again.
+def bl_read_mem(bus, board_id, first_word, count, credit=DEFAULT_READ_CREDIT, timeout_sec=0.1, retries=10,
+                progress=None):
+    data = bytearray()
+    while len(data) < count * 4:
+        word = first_word + len(data) // 4
+        chunk = min(count - len(data) // 4, READ_PAGE_WORDS)
+        for i in range(retries):
+            d = bl_read_chunk(bus, board_id, word, chunk, credit, timeout_sec)
+            if d is not None:
+                break
+        else:
+            raise RuntimeError('Did not receive flash data from board')
+        data += d
+        if progress is not None:
+            progress(len(data) // 4, count)
+    return bytes(data)
+
+
+# Read the crash record of a board as a list of words (see struct crash_record_t), or None if there is none
+def bl_read_crash(bus, board_id, timeout_sec=0.1, retries=10):
+    for i in range(retries):
+        d = bl_read_chunk(bus, board_id, 0, CRASH_WORDS, DEFAULT_READ_CREDIT, timeout_sec, cmd=BL_READ_CRASH)
+        if d is not None:
+            words = [int.from_bytes(d[a:a + 4], 'little') for a in range(0, len(d), 4)]
+            return words if words[0] == CRASH_MAGIC else None
+    raise RuntimeError('Did not receive crash record from board')
+
+
+# Read the CRC of each app page in [first_page, first_page + count). Returns {page: crc} for the replies received.
+def bl_page_crcs(bus, board_id, first_page, count, timeout_sec=0.1, busy_retries=BUSY_RETRIES):
+    bl_cmd(bus, board_id, BL_PAGE_CRC, first_page, count.to_bytes(4, 'big'))
+    crcs = {}
+    # Replies are sent back to back, so the timeout restarts with every reply
+    while len(crcs) < count:
+        m = bl_waitresp_msg(bus, board_id, BL_PAGE_CRC, timeout_sec)
+        if m is None:
+            break
+        if m.data[2] == BL_ERR_BUSY and busy_retries > 0:
+            time.sleep(BUSY_DELAY_SEC)
+            return bl_page_crcs(bus, board_id, first_page, count, timeout_sec, busy_retries - 1)
+        if m.data[2] > 0:
+            raise RuntimeError(f'Bootloader command {BL_PAGE_CRC} error #{m.data[2]}')
+        crcs[m.data[3]] = int.from_bytes(m.data[4:8], 'little')
+    return crcs
+
+
+# Find the pages whose CRC on the board differs from pages, a list of (page CRC, page data). first_page is the board
+# page pages[0] goes to.
+def bl_changed_pages(bus, board_id, pages, first_page=0):
+    crcs = bl_page_crcs(bus, board_id, first_page, len(pages))
+    # Pages whose reply was lost count as changed
+    return [p for p, (pcrc, _) in enumerate(pages) if crcs.get(first_page + p) != pcrc.crcValue]
+
+
+# Get (page count, CRC) of the app installed on a board, or None if there is none or flash no longer matches its CRC
+def bl_app_info(bus, board_id, timeout_sec=0.1, retries=10):
+    for i in range(retries):
+        bl_cmd(bus, board_id, BL_APP_INFO, 0, [0] * 4)
+        m = bl_waitresp_msg(bus, board_id, BL_APP_INFO, timeout_sec)
+        if m is not None:
+            if m.data[2] > 0:
+                return None
+            return m.data[3], int.from_bytes(m.data[4:8], 'little')
+    raise RuntimeError('Did not receive reply from board')
+
+
+STATS_RX = 0
+STATS_TX = 1
+
+
+# Get the statistics of a board.
+# STATS_RX: (most frames queued, frames dropped by the queue, CAN FIFO overruns)
+# STATS_TX: (most replies queued, replies dropped by the queue, 0)
+def bl_stats(bus, board_id, clear=False, which=STATS_RX, timeout_sec=0.1, retries=10):
+    for i in range(retries):
+        bl_cmd(bus, board_id, BL_STATS, 1 if clear else 0, which.to_bytes(4, 'big'))
+        m = bl_waitresp_msg(bus, board_id, BL_STATS, timeout_sec)
+        if m is not None:
+            if m.data[2] > 0:
+                raise RuntimeError(f'Bootloader command {BL_STATS} error #{m.data[2]}')
+            return m.data[3], int.from_bytes(m.data[4:6], 'little'), int.from_bytes(m.data[6:8], 'little')
+    raise RuntimeError('Did not receive reply from board')
+
+
 def bl_wait_for_connection(bus, board_id, timeout_sec=0.1, retries=10):
     for i in range(retries):
         # Ping bootloader
@@ -76,6 +359,18 @@ def bl_wait_for_connection(bus, board_id, timeout_sec=0.1, retries=10):
     return False
 
 
+# Get the capability flags of a board. Old bootloaders don't report any.
+def bl_get_caps(bus, board_id, timeout_sec=0.1, retries=10):
+    for i in range(retries):
+        bl_cmd(bus, board_id, BL_PING, 0, [0] * 4)
+        m = bl_waitresp_msg(bus, board_id, BL_PING, timeout_sec)
+        if m is not None:
+            if m.dlc >= 7:
+                return int.from_bytes(m.data[3:7], 'little')
+            return 0
+    raise RuntimeError('Did not receive reply from board')
+
+
 def bl_list_connected_boards(bus, timeout_sec=0.1, retries=10):
     board_ids = set()
     for i in range(retries):
@@ -92,7 +387,7 @@ def bl_list_connected_boards(bus, timeout_sec=0.1, retries=10):
     return board_ids
 
 
-def get_can_bus(channel=None):
+def default_channel(channel=None):
     if channel is None:
         if platform == "linux" or platform == "linux2" or platform == "darwin":
             # Stock slcan firmware on Linux (Assuming os x works the same?)
@@ -101,9 +396,48 @@ def get_can_bus(channel=None):
             channel = 'COM0'
         else:
             raise ValueError('Channel not specified and OS not recognized')
-    if "COM" in channel or "/dev" in channel:
-        bus = can.interface.Bus(bustype='slcan', channel=channel, bitrate=500000)
+    return channel
+
+
+def is_slcan_channel(channel):
+    channel = default_channel(channel)
+    return "COM" in channel or "/dev" in channel
+
+
+def get_can_bus(channel=None, bitrate=DEFAULT_BITRATE):
+    channel = default_channel(channel)
+    if is_slcan_channel(channel):
+        bus = can.interface.Bus(bustype='slcan', channel=channel, bitrate=bitrate)
     else:
-        bus = can.interface.Bus(interface='socketcan', channel=channel, bitrate=500000)
+        bus = can.interface.Bus(interface='socketcan', channel=channel, bitrate=bitrate)
 
     return bus
+
+
+# Move boards and the host to another bit rate for the rest of the session. Pass a group to switch all of board_ids
+# with one command, so they change at the same time. Returns the bus to use from now on and whether the switch worked.
+# If it didn't, the boards go back to DEFAULT_BITRATE by themselves and the returned bus is at DEFAULT_BITRATE.
+# Only slcan adapters can be switched from here. Socketcan bit rates are set with ip link.
+def bl_switch_bitrate(bus, channel, board_ids, bitrate, group=0, timeout_sec=0.1):
+    if group:
+        bl_cmd(bus, group, BL_BITRATE, BL_BITRATES[bitrate], [0] * 4, can_id=CANID_BL_GRP_CMD)
+        replies = bl_waitresp_all(bus, board_ids, BL_BITRATE, timeout_sec)
+    else:
+        bl_cmd(bus, board_ids[0], BL_BITRATE, BL_BITRATES[bitrate], [0] * 4)
+        m = bl_waitresp_msg(bus, board_ids[0], BL_BITRATE, timeout_sec)
+        replies = {board_ids[0]: m} if m is not None else {}
+    if not all(i in replies and replies[i].data[2] == 0 for i in board_ids):
+        # Any board that did switch hears nothing valid and comes back
+        time.sleep(BITRATE_FALLBACK_SEC)
+        return bus, False
+
+    time.sleep(BITRATE_SETTLE_SEC)
+    bus.shutdown()
+    bus = get_can_bus(channel, bitrate)
+    # The pings also tell the boards that the new bit rate works
+    if all(bl_wait_for_connection(bus, i, retries=3) for i in board_ids):
+        return bus, True
+
+    bus.shutdown()
+    time.sleep(BITRATE_FALLBACK_SEC)
+    return get_can_bus(channel), False
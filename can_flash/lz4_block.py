@@ -0,0 +1,119 @@
+# Minimal LZ4 block format compressor/decompressor.
+# Compressed pages are decompressed by the bootloader (lz4_decompress in Src/main.c), so this has to produce plain
+# LZ4 blocks without a frame header or stored size.
+# A dictionary is treated as if it came right before the data, so matches can reach back into it. Delta updates use
+# the app as it is in flash as the dictionary.
+
+MIN_MATCH = 4
+LAST_LITERALS = 5  # The last 5 bytes of a block are always literals
+MF_LIMIT = 12  # The last match must start at least 12 bytes before the end of the block
+MAX_OFFSET = 0xFFFF
+
+
+def _write_length(out, length):
+    # Lengths of 15 and up continue in extra bytes of 255
+    length -= 15
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def _write_sequence(out, literals, match_len, offset):
+    lit_len = len(literals)
+    token = (min(lit_len, 15) << 4)
+    if match_len:
+        token |= min(match_len - MIN_MATCH, 15)
+    out.append(token)
+    if lit_len >= 15:
+        _write_length(out, lit_len)
+    out += literals
+    if match_len:
+        out += offset.to_bytes(2, 'little')
+        if match_len - MIN_MATCH >= 15:
+            _write_length(out, match_len - MIN_MATCH)
+
+
+def _match_length(data, ref, i, limit):
+    length = 0
+    while i + length < limit and data[ref + length] == data[i + length]:
+        length += 1
+    return length
+
+
+# repeat_offset is an offset that is always tried besides the last occurrence of each sequence. For delta updates this
+# is the distance back to the same page in the old image, which catches data that didn't move.
+def compress(data, dictionary=b'', repeat_offset=0):
+    dictionary = bytes(dictionary[-MAX_OFFSET:])
+    data = dictionary + bytes(data)
+    end = len(data)
+    out = bytearray()
+    table = {}  # Last position of each 4 byte sequence
+    for j in range(len(dictionary) - MIN_MATCH + 1):
+        table[data[j:j + MIN_MATCH]] = j
+    anchor = len(dictionary)  # Start of pending literals
+    i = anchor
+    match_limit = end - LAST_LITERALS
+    while i + MF_LIMIT <= end:
+        key = data[i:i + MIN_MATCH]
+        ref = table.get(key)
+        table[key] = i
+        length = 0
+        if ref is not None and i - ref <= MAX_OFFSET:
+            length = _match_length(data, ref, i, match_limit)
+        if 0 < repeat_offset <= min(i, MAX_OFFSET):
+            repeat_length = _match_length(data, i - repeat_offset, i, match_limit)
+            if repeat_length > length:
+                ref, length = i - repeat_offset, repeat_length
+        if length < MIN_MATCH:
+            i += 1
+            continue
+
+        _write_sequence(out, data[anchor:i], length, i - ref)
+        for j in range(i + 1, min(i + length, end - MIN_MATCH + 1)):
+            table[data[j:j + MIN_MATCH]] = j
+        i += length
+        anchor = i
+
+    _write_sequence(out, data[anchor:], 0, 0)
+    return bytes(out)
+
+
+def _read_length(block, i):
+    length = 0
+    while True:
+        b = block[i]
+        i += 1
+        length += b
+        if b != 255:
+            return length, i
+
+
+def decompress(block, dictionary=b''):
+    out = bytearray(dictionary)
+    i = 0
+    while i < len(block):
+        token = block[i]
+        i += 1
+        lit_len = token >> 4
+        if lit_len == 15:
+            extra, i = _read_length(block, i)
+            lit_len += extra
+        out += block[i:i + lit_len]
+        i += lit_len
+        if i >= len(block):
+            break
+
+        offset = int.from_bytes(block[i:i + 2], 'little')
+        i += 2
+        match_len = token & 0x0F
+        if match_len == 15:
+            extra, i = _read_length(block, i)
+            match_len += extra
+        match_len += MIN_MATCH
+        if offset == 0 or offset > len(out):
+            raise ValueError('Invalid LZ4 match offset')
+        # Copy byte by byte, matches may overlap the output
+        for _ in range(match_len):
+            out.append(out[-offset])
+    return bytes(out[len(dictionary):])
@@ -61,6 +61,10 @@ defined in linker script */
   .type Reset_Handler, %function
 Reset_Handler:
 
+/* Bootloader support - Run PreSystemInit to check for magic value and jump to app.
+   Goes first so the jump doesn't wait for the data/bss init. PreSystemInit only uses .noinit. */
+    bl PreSystemInit
+
 /* Copy the data segment initializers from flash to SRAM */
   movs r1, #0
   b LoopCopyDataInit
@@ -89,8 +93,20 @@ LoopFillZerobss:
   cmp r2, r3
   bcc FillZerobss
 
-/* Bootloader support - Run PreSystemInit to check for magic value and jump to app */
-    bl PreSystemInit
+/* Copy the code that runs from RAM (.ramfunc) from flash to SRAM */
+  ldr r0, =_sramfunc
+  ldr r1, =_eramfunc
+  ldr r2, =_siramfunc
+  b LoopCopyRamfunc
+
+CopyRamfunc:
+  ldr r3, [r2], #4
+  str r3, [r0], #4
+
+LoopCopyRamfunc:
+  cmp r0, r1
+  bcc CopyRamfunc
+
 /* Call the clock system intitialization function.*/
     bl  SystemInit
 /* Call static constructors */